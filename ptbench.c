@@ -0,0 +1,487 @@
+/*
+ * ptbench: micro-benchmarks for the rastertoptch raster hot path.
+ *
+ * Generates synthetic label raster data for each printer model class
+ * and measures the stages a line goes through in rastertoptch:
+ *
+ *   emit      the line plan's function (vectorised kernel for long
+ *             lines, specialised generate_emit_line otherwise)
+ *   emit-ref  generate_emit_line (scalar reference)
+ *   rle       rle_encoder (vectorised when available)
+ *   rle-ref   RLE_encode_reference (scalar reference)
+ *   store     the line plan's function storing lines into rle_buffer
+ *             (RLE or ULP, per model; specialised per printer family
+ *             and line length for RLE)
+ *   flush     flush_rle_buffer to /dev/null
+ *   page      process_rasterdata on whole synthetic raster pages
+ *
+ * The vectorised kernels are also checked against the references; any
+ * difference is reported, and makes ptbench exit with status 1.
+ */
+#define RASTERTOPTCH_NO_MAIN
+#include "rastertoptch.c"
+
+#include <sys/stat.h>
+
+/** Number of distinct synthetic lines per benchmark case. */
+#define BENCH_LINES 4096
+/** Number of pages in the synthetic raster for the page stage. */
+#define BENCH_PAGES 4
+
+/**
+ * A benchmark case: one printer model class.
+ */
+struct bench_case {
+  const char* name;     /**< Case name                            */
+  const char* options;  /**< Job options, as for rastertoptch     */
+  unsigned xdpi, ydpi;  /**< Resolution                           */
+  unsigned width;       /**< Raster width in pixels               */
+  unsigned height;      /**< Raster page height in pixels         */
+  bool negative;        /**< NegativePrint page header flag       */
+  bool mirror;          /**< MirrorPrint page header flag         */
+};
+
+struct bench_case cases [] = {
+  { "ql-ulp-90", "QL BytesPerLine=90 PixelXfer=ULP LabelPreamble",
+    300, 300, 720, 1200, false, false },
+  { "ql-ulp-90-neg", "QL BytesPerLine=90 PixelXfer=ULP LabelPreamble",
+    300, 300, 720, 1200, true, false },
+  { "pt-rle-16", "PT BytesPerLine=16 PixelXfer=RLE Align=Center",
+    180, 180, 128, 1000, false, false },
+  { "pt-rle-16-mirror",
+    "PT BytesPerLine=16 PixelXfer=RLE Align=Center MirrorPrint SoftwareMirror",
+    180, 180, 128, 1000, false, true },
+  { "p900w-rle-70", "PT BytesPerLine=70 PixelXfer=RLE Align=Center",
+    360, 720, 454, 2000, false, false },
+  { "p900w-rle-70-neg", "PT BytesPerLine=70 PixelXfer=RLE Align=Center",
+    360, 720, 454, 2000, true, false },
+  { "ptpc-bip-3", "PT BytesPerLine=3 PixelXfer=BIP Align=Center",
+    180, 180, 24, 1000, false, false },
+};
+
+/** Minimum time to run each stage for, in seconds. */
+double min_time = 0.2;
+/** Stream the report is written to (standard output is /dev/null). */
+FILE* report;
+/** Number of mismatches between kernels and references. */
+int mismatches = 0;
+
+/** State of the synthetic data random number generator. */
+uint64_t rng_state;
+
+static uint32_t
+rng (void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state >> 32;
+}
+
+/**
+ * Generate a synthetic label line: blank lines between text rows,
+ * text rows made of glyph-like bytes between blank stretches, and
+ * bars that repeat for a number of lines.
+ * @param line   Buffer for the line
+ * @param len    Length of the line
+ * @param y      Line number
+ * @param prev   Previous line, or NULL
+ */
+static void
+synth_line (unsigned char* line, unsigned len, unsigned y,
+            const unsigned char* prev) {
+  unsigned phase = y % 64;
+  if (phase < 12) {
+    memset (line, 0, len);
+  } else if (phase < 20 && prev) {
+    memcpy (line, prev, len);  /* Barcode bars */
+  } else if (phase < 20) {
+    unsigned i;
+    for (i = 0; i < len; i++)
+      line [i] = (rng () & 1) ? 0xff : 0x00;
+  } else {
+    unsigned i;
+    for (i = 0; i < len; i++) {
+      unsigned r = rng () % 8;
+      line [i] = r < 4 ? 0x00 : r < 5 ? 0xff : r < 6 ? 0x3c : rng ();
+    }
+  }
+}
+
+/**
+ * Fill in a page header for a benchmark case.
+ * @param c       Benchmark case
+ * @param header  Page header
+ */
+static void
+synth_header (const struct bench_case* c, cups_page_header2_t* header) {
+  memset (header, 0, sizeof (*header));
+  header->HWResolution [0] = c->xdpi;
+  header->HWResolution [1] = c->ydpi;
+  header->cupsWidth = c->width;
+  header->cupsHeight = c->height;
+  header->cupsBitsPerColor = 1;
+  header->cupsBitsPerPixel = 1;
+  header->cupsBytesPerLine = (c->width + 7) / 8;
+  header->cupsColorOrder = CUPS_ORDER_CHUNKED;
+  header->cupsColorSpace = CUPS_CSPACE_K;
+  header->NegativePrint = c->negative;
+  header->MirrorPrint = c->mirror;
+  header->NumCopies = 1;
+  header->cupsPageSize [0] = c->width * 72.0 / c->xdpi;
+  header->cupsPageSize [1] = c->height * 72.0 / c->ydpi;
+  header->PageSize [0] = header->cupsPageSize [0];
+  header->PageSize [1] = header->cupsPageSize [1];
+  header->cupsImagingBBox [2] = header->cupsPageSize [0];
+  header->cupsImagingBBox [3] = header->cupsPageSize [1];
+  header->ImagingBoundingBox [2] = header->PageSize [0];
+  header->ImagingBoundingBox [3] = header->PageSize [1];
+}
+
+/**
+ * Reset the global filter state, as at the start of a job.
+ */
+static void
+reset_filter_state (void) {
+  max_lines_waiting = INT_MAX;
+  lines_waiting = 0;
+  empty_lines = 0;
+  page_lines = 0;
+  preamble_up_front = false;
+  preamble_emitted = false;
+  wire_compression = -1;
+  ulp_direct = false;
+  ulp_empty_xormask = -1;
+  rle_empty_xormask = -1;
+  preamble_template.valid = false;
+  memset (&progress, 0, sizeof (progress));
+}
+
+static void
+print_row (const char* name, const char* stage,
+           double seconds, unsigned long lines, double bytes) {
+  fprintf (report, "%-18s %-9s %10.3f %9.1f %10.1f\n",
+	   name, stage, lines / seconds / 1e6, seconds * 1e9 / lines,
+	   bytes / lines);
+}
+
+/**
+ * Run the line stages of a benchmark case.
+ * @param c  Benchmark case
+ */
+static void
+bench_lines (const struct bench_case* c) {
+  job_options_t job_options = parse_job_options (c->options);
+  cups_page_header2_t header;
+  synth_header (c, &header);
+  reset_filter_state ();
+  job_options.page = 1;
+  job_options.last_page = true;
+
+  /* Line parameters, as emit_raster_lines uses them */
+  int bytes_per_line = job_options.bytes_per_line;
+  line_plan.valid = false;
+  const line_plan_t* plan = prepare_line_plan (&job_options, &header);
+  int do_mirror = plan->do_mirror;
+  unsigned buflen = plan->buflen;
+  int right_padding_bytes = plan->right_padding_bytes;
+  int shift = plan->shift;
+  unsigned char xormask = plan->xormask;
+
+  unsigned in_len = header.cupsBytesPerLine;
+  unsigned char* in = malloc ((size_t) BENCH_LINES * in_len);
+  /* RLE_encode_reference reads one byte past the end of its input */
+  unsigned char* out = malloc ((size_t) BENCH_LINES * bytes_per_line + 1);
+  unsigned char* ref = malloc (bytes_per_line);
+  unsigned char* rle = malloc (4 + bytes_per_line + bytes_per_line / 128);
+  unsigned char* rle_ref = malloc (4 + bytes_per_line + bytes_per_line / 128);
+  bool* nonempty = malloc (BENCH_LINES * sizeof (bool));
+  if (!in || !out || !ref || !rle || !rle_ref || !nonempty) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    exit (1);
+  }
+  unsigned i;
+  rng_state = 0x9e3779b97f4a7c15ULL;
+  for (i = 0; i < BENCH_LINES; i++)
+    synth_line (in + i * in_len, in_len, i,
+		i ? in + (i - 1) * in_len : NULL);
+
+  /* Check the kernels against the references */
+  unsigned long rle_bytes = 0;
+  for (i = 0; i < BENCH_LINES; i++) {
+    unsigned char* o = out + i * bytes_per_line;
+    nonempty [i] = plan->emit_line (in + i * in_len, o, buflen,
+				    bytes_per_line, right_padding_bytes,
+				    shift, do_mirror, xormask);
+    bool ref_nonempty = generate_emit_line (in + i * in_len, ref, buflen,
+					    bytes_per_line,
+					    right_padding_bytes, shift,
+					    do_mirror, xormask);
+    if (nonempty [i] != ref_nonempty
+	|| memcmp (o, ref, bytes_per_line) != 0) {
+      fprintf (stderr, "MISMATCH: %s: line plan line %u\n",
+	       c->name, i);
+      mismatches++;
+    }
+    emit_line_kernel (in + i * in_len, o, buflen, bytes_per_line,
+		      right_padding_bytes, shift, do_mirror, xormask);
+    if (memcmp (o, ref, bytes_per_line) != 0) {
+      fprintf (stderr, "MISMATCH: %s: emit_line_kernel line %u\n",
+	       c->name, i);
+      mismatches++;
+    }
+    unsigned char nz, nz_ref;
+    unsigned char* end = rle_encoder (rle, o, bytes_per_line, &nz);
+    unsigned char* end_ref = RLE_encode_reference (rle_ref, o,
+						   bytes_per_line, &nz_ref);
+    if (!nz != !nz_ref
+	|| (nz && (end - rle != end_ref - rle_ref
+		   || memcmp (rle, rle_ref, end - rle) != 0))) {
+      fprintf (stderr, "MISMATCH: %s: rle_encoder line %u\n", c->name, i);
+      mismatches++;
+    }
+    rle_bytes += nz ? 3 + (end_ref - rle_ref) : 1;
+  }
+
+  /* emit and emit-ref */
+  int k;
+  for (k = 0; k < 2; k++) {
+    unsigned long lines = 0;
+    double start = monotonic_time (), elapsed;
+    do {
+      for (i = 0; i < BENCH_LINES; i++)
+	if (k == 0)
+	  plan->emit_line (in + i * in_len, out + i * bytes_per_line,
+			   buflen, bytes_per_line, right_padding_bytes,
+			   shift, do_mirror, xormask);
+	else
+	  generate_emit_line (in + i * in_len, out + i * bytes_per_line,
+			      buflen, bytes_per_line, right_padding_bytes,
+			      shift, do_mirror, xormask);
+      lines += BENCH_LINES;
+    } while ((elapsed = monotonic_time () - start) < min_time);
+    print_row (c->name, k == 0 ? "emit" : "emit-ref", elapsed, lines,
+	       (double) bytes_per_line * lines);
+  }
+
+  /* rle and rle-ref */
+  for (k = 0; k < 2; k++) {
+    unsigned long lines = 0;
+    double start = monotonic_time (), elapsed;
+    do {
+      for (i = 0; i < BENCH_LINES; i++) {
+	unsigned char nz;
+	if (k == 0)
+	  rle_encoder (rle, out + i * bytes_per_line, bytes_per_line, &nz);
+	else
+	  RLE_encode_reference (rle, out + i * bytes_per_line,
+				bytes_per_line, &nz);
+      }
+      lines += BENCH_LINES;
+    } while ((elapsed = monotonic_time () - start) < min_time);
+    print_row (c->name, k == 0 ? "rle" : "rle-ref", elapsed, lines,
+	       (double) rle_bytes * (lines / BENCH_LINES));
+  }
+
+  /* Check the line plan's store function against store_line */
+  for (i = 0; i < BENCH_LINES && plan->store_line != store_line; i++) {
+    unsigned char* o = out + i * bytes_per_line;
+    store_line (&job_options, &header, o);
+    unsigned long len = rle_buffer_next - rle_buffer;
+    memcpy (rle_ref, rle_buffer, len);
+    rle_buffer_next = rle_buffer;
+    plan->store_line (&job_options, &header, o);
+    if (rle_buffer_next - rle_buffer != len
+	|| memcmp (rle_buffer, rle_ref, len) != 0) {
+      fprintf (stderr, "MISMATCH: %s: line plan store line %u\n",
+	       c->name, i);
+      mismatches++;
+    }
+    rle_buffer_next = rle_buffer;
+    lines_waiting = 0;
+  }
+
+  /* store and flush, a batch of BENCH_LINES lines at a time */
+  unsigned long lines = 0, bytes = 0;
+  double store_time = 0, flush_time = 0;
+  do {
+    double start = monotonic_time ();
+    for (i = 0; i < BENCH_LINES; i++) {
+      if (nonempty [i]) {
+	if (empty_lines) {
+	  store_empty_lines (&job_options, &header, empty_lines, xormask);
+	  empty_lines = 0;
+	}
+	plan->store_line (&job_options, &header, out + i * bytes_per_line);
+      } else
+	empty_lines++;
+    }
+    store_empty_lines (&job_options, &header, empty_lines, xormask);
+    empty_lines = 0;
+    double mid = monotonic_time ();
+    bytes += rle_buffer_next - rle_buffer;
+    flush_rle_buffer (&job_options, &header);
+    output_flush ();
+    store_time += mid - start;
+    flush_time += monotonic_time () - mid;
+    lines += BENCH_LINES;
+  } while (store_time + flush_time < min_time);
+  print_row (c->name, "store", store_time, lines, bytes);
+  print_row (c->name, "flush", flush_time, lines, bytes);
+
+  free_job_buffers ();
+  free (in);
+  free (out);
+  free (ref);
+  free (rle);
+  free (rle_ref);
+  free (nonempty);
+}
+
+/**
+ * Run the page stage of a benchmark case: rastertoptch on
+ * BENCH_PAGES synthetic pages.
+ * @param c  Benchmark case
+ */
+static void
+bench_page (const struct bench_case* c) {
+  char in_name [] = "/tmp/ptbench-in-XXXXXX";
+  char out_name [] = "/tmp/ptbench-out-XXXXXX";
+  int in_fd = mkstemp (in_name);
+  int out_fd = mkstemp (out_name);
+  if (in_fd < 0 || out_fd < 0) {
+    fprintf (stderr, "ERROR: Cannot create temporary files: %s\n",
+	     strerror (errno));
+    exit (1);
+  }
+  unlink (in_name);
+  unlink (out_name);
+
+  /* Write the synthetic raster data; pages differ, so that the page */
+  /* cache is not measured instead                                   */
+  cups_page_header2_t header;
+  synth_header (c, &header);
+  cups_raster_t* ras = cupsRasterOpen (in_fd, CUPS_RASTER_WRITE);
+  unsigned char* line = malloc (header.cupsBytesPerLine);
+  unsigned char* prev = malloc (header.cupsBytesPerLine);
+  if (!ras || !line || !prev) {
+    fprintf (stderr, "ERROR: Cannot write synthetic raster data\n");
+    exit (1);
+  }
+  rng_state = 0x2545f4914f6cdd1dULL;
+  unsigned p, y;
+  for (p = 0; p < BENCH_PAGES; p++) {
+    cupsRasterWriteHeader2 (ras, &header);
+    for (y = 0; y < header.cupsHeight; y++) {
+      synth_line (line, header.cupsBytesPerLine, y, y ? prev : NULL);
+      cupsRasterWritePixels (ras, line, header.cupsBytesPerLine);
+      memcpy (prev, line, header.cupsBytesPerLine);
+    }
+  }
+  cupsRasterClose (ras);
+  free (line);
+  free (prev);
+
+  /* Run the filter with the raster data as standard input, and the  */
+  /* output file as standard output; hide its messages               */
+  int saved_in = dup (0), saved_out = dup (1), saved_err = dup (2);
+  int null_fd = open ("/dev/null", O_WRONLY);
+  dup2 (in_fd, 0);
+  dup2 (out_fd, 1);
+  dup2 (null_fd, 2);
+  unsigned long lines = 0;
+  off_t bytes = 0;
+  double start = monotonic_time (), elapsed;
+  do {
+    lseek (0, 0, SEEK_SET);
+    lseek (1, 0, SEEK_SET);
+    if (ftruncate (1, 0) != 0) {
+      dup2 (saved_err, 2);
+      fprintf (stderr, "ERROR: Cannot truncate output file: %s\n",
+	       strerror (errno));
+      exit (1);
+    }
+    reset_filter_state ();
+    job_options_t job_options = parse_job_options (c->options);
+    process_rasterdata (&job_options);
+    struct stat st;
+    fstat (1, &st);
+    bytes += st.st_size;
+    lines += BENCH_PAGES * header.cupsHeight;
+  } while ((elapsed = monotonic_time () - start) < min_time);
+  dup2 (saved_in, 0);
+  dup2 (saved_out, 1);
+  dup2 (saved_err, 2);
+  close (saved_in);
+  close (saved_out);
+  close (saved_err);
+  close (null_fd);
+  close (in_fd);
+  close (out_fd);
+  print_row (c->name, "page", elapsed, lines, bytes);
+}
+
+static void
+usage (void) {
+  printf ("Usage: %s [-t SECONDS] [CASE...]\n"
+	  "\n"
+	  "Benchmark the rastertoptch raster hot path on synthetic data.\n"
+	  "\n"
+	  "Options:\n"
+	  "  -t SECONDS  minimum time to run each stage for [0.2]\n"
+	  "  -h          display this help and exit\n"
+	  "\n"
+	  "Cases:\n", progname);
+  unsigned i;
+  for (i = 0; i < sizeof (cases) / sizeof (cases [0]); i++)
+    printf ("  %-18s %s\n", cases [i].name, cases [i].options);
+}
+
+int
+main (int argc, char* argv []) {
+  progname = basename (argv [0]);
+  int c;
+  while ((c = getopt (argc, argv, "ht:")) != -1) {
+    switch (c) {
+    case 't':
+      min_time = atof (optarg);
+      break;
+    case 'h':
+      usage ();
+      exit (0);
+    default:
+      fprintf (stderr, "Try '%s -h' for more information\n", progname);
+      exit (2);
+    }
+  }
+
+  /* Printer data goes to standard output; keep it for the report */
+  report = fdopen (dup (1), "w");
+  int null_fd = open ("/dev/null", O_WRONLY);
+  if (!report || null_fd < 0) {
+    fprintf (stderr, "ERROR: Cannot redirect output\n");
+    exit (1);
+  }
+  dup2 (null_fd, 1);
+  close (null_fd);
+
+  select_line_kernels ();
+  fprintf (report, "%-18s %-9s %10s %9s %10s\n",
+	   "case", "stage", "Mlines/s", "ns/line", "bytes/line");
+  unsigned i;
+  for (i = 0; i < sizeof (cases) / sizeof (cases [0]); i++) {
+    int j;
+    bool selected = optind == argc;
+    for (j = optind; j < argc; j++)
+      if (strcmp (argv [j], cases [i].name) == 0)
+	selected = true;
+    if (!selected)
+      continue;
+    bench_lines (cases + i);
+    bench_page (cases + i);
+    fflush (report);
+  }
+  if (mismatches)
+    fprintf (stderr, "%s: %d mismatches between kernels and references\n",
+	     progname, mismatches);
+  return mismatches != 0;
+}
@@ -14,6 +14,10 @@
 #include <assert.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <sys/wait.h>
+#if HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
 #if HAVE_LIBPNG
 # include <png.h>
@@ -26,6 +30,8 @@
 
 #define COMMAND_STACK_SIZE 128
 #define HEX_CHUNK_SIZE 16
+#define INPUT_BLOCK_SIZE 65536
+#define IMAGE_SPILL_SIZE (16 << 20)
 
 #if COMMAND_STACK_SIZE < HEX_CHUNK_SIZE
 #error COMMAND_STACK_SIZE must be >= HEX_CHUNK_SIZE
@@ -34,6 +40,7 @@
 bool silent;
 bool verbose;
 const char *write_prefix;
+int compression_level = -1;
 unsigned int noisy_commands_ignored;
 
 enum data_type {
@@ -62,6 +69,129 @@ struct color colors[] = {
   { "\e[31;1m", "\e[0m" },
 };
 
+enum summary_format {
+  NO_SUMMARY,
+  SUMMARY_JSON,
+  SUMMARY_TSV
+};
+
+/*
+ * Counts for the summary of a file
+ */
+struct summary {
+  unsigned long commands;
+  unsigned long raster_lines;
+  unsigned long zero_lines;
+  unsigned long pages;
+  unsigned long jobs;
+  unsigned int compression;  /* (1 << compression_mode) for each mode selected */
+  unsigned long errors;      /* error messages */
+  unsigned long error_bytes; /* bytes marked as errors */
+  unsigned long images;
+  unsigned int width;        /* width of the widest image in pixels */
+  unsigned long height;      /* height of the tallest image in rows */
+  int row_size;              /* row size of the current image */
+  unsigned long rows;        /* rows of the current image */
+};
+struct summary summary = {
+  .row_size = -1,
+};
+
+enum summary_format summary_format;
+FILE *summary_file;
+const char *summary_name = "-";
+
+static void print_summary_header (FILE *file) {
+  if (summary_format == SUMMARY_TSV)
+    fprintf (file, "file\tstatus\tcommands\traster_lines\tzero_lines\t"
+		   "pages\tjobs\tcompression\timages\twidth\theight\t"
+		   "errors\terror_bytes\n");
+}
+
+static void print_summary (FILE *file, const char *name, int status) {
+  static const char *compression_names[] = {
+    "unspecified", "none", "tiff", "mixed"
+  };
+  const char *compression = compression_names[(summary.compression >> 1) & 3];
+
+  if (summary_format == SUMMARY_TSV) {
+    /* Escape the name, so that each file takes one line of fields */
+    for (; *name; name++) {
+      switch (*name) {
+      case '\t':
+	fputs ("\\t", file);
+	break;
+      case '\n':
+	fputs ("\\n", file);
+	break;
+      case '\r':
+	fputs ("\\r", file);
+	break;
+      case '\\':
+	fputs ("\\\\", file);
+	break;
+      default:
+	if ((unsigned char) *name < 0x20 || *name == 0x7f)
+	  fprintf (file, "\\x%02x", (unsigned char) *name);
+	else
+	  putc (*name, file);
+      }
+    }
+    fprintf (file, "\t%d\t%lu\t%lu\t%lu\t%lu\t%lu\t%s\t%lu\t%u\t%lu\t"
+		   "%lu\t%lu\n",
+	     status, summary.commands, summary.raster_lines,
+	     summary.zero_lines, summary.pages, summary.jobs, compression,
+	     summary.images, summary.width, summary.height,
+	     summary.errors, summary.error_bytes);
+  } else {
+    fprintf (file, "{\"file\": \"");
+    for (; *name; name++) {
+      if (*name == '"' || *name == '\\')
+	fprintf (file, "\\%c", *name);
+      else if ((unsigned char) *name < 0x20)
+	fprintf (file, "\\u%04x", *name);
+      else
+	putc (*name, file);
+    }
+    fprintf (file, "\", \"status\": %d, \"commands\": %lu, "
+		   "\"raster_lines\": %lu, \"zero_lines\": %lu, "
+		   "\"pages\": %lu, \"jobs\": %lu, \"compression\": \"%s\", "
+		   "\"images\": %lu, \"width\": %u, \"height\": %lu, "
+		   "\"errors\": %lu, \"error_bytes\": %lu}\n",
+	     status, summary.commands, summary.raster_lines,
+	     summary.zero_lines, summary.pages, summary.jobs, compression,
+	     summary.images, summary.width, summary.height,
+	     summary.errors, summary.error_bytes);
+  }
+}
+
+
+static void summary_row (int row_size) {
+  if (summary.row_size == -1)
+    summary.row_size = row_size;
+  summary.rows++;
+}
+
+static void summary_image_end (void) {
+  if (summary.rows) {
+    summary.images++;
+    if (summary.row_size != -1 && summary.row_size * 8 > summary.width)
+      summary.width = summary.row_size * 8;
+    if (summary.rows > summary.height)
+      summary.height = summary.rows;
+  }
+  summary.row_size = -1;
+  summary.rows = 0;
+}
+
+static void finish (int status) {
+  if (summary_file) {
+    summary_image_end ();
+    print_summary (summary_file, summary_name, status);
+  }
+  exit (status);
+}
+
 static void flush_silent_commands (void) {
   if (noisy_commands_ignored) {
     printf ("(%u commands hidden)\n",
@@ -76,6 +206,8 @@ static void print_message (enum data_type type, const char *fmt, ...)
   struct color *color = colors + type;
   va_list ap;
 
+  if (type == ERROR)
+    summary.errors++;
   flush_silent_commands ();
   va_start (ap, fmt);
   printf ("%s", color->on);
@@ -84,6 +216,91 @@ static void print_message (enum data_type type, const char *fmt, ...)
   va_end (ap);
 }
 
+static void grow_buffer (unsigned char **buffer, unsigned long *reserved, unsigned long min_size) {
+  unsigned char *new_buffer;
+  unsigned int new_size;
+
+  if (min_size <= *reserved)
+    return;
+  if (*reserved)
+    new_size = *reserved << 1;
+  else
+    new_size = 64;
+  while (new_size < min_size)
+    new_size <<= 1;
+  new_buffer = realloc (*buffer, new_size);
+  if (! new_buffer) {
+    fprintf(stderr, "Out of memory\n");
+    exit (1);
+  }
+  *buffer = new_buffer;
+  *reserved = new_size;
+}
+
+/*
+ * The input is mapped if it is a regular file, and read in blocks
+ * otherwise, so that the bytes of a command can be used where they
+ * are in data.
+ */
+struct input {
+  const unsigned char *data;
+  unsigned long len;
+  unsigned long pos;
+  unsigned char *buffer;
+  unsigned long reserved;
+  bool eof;
+};
+struct input input;
+
+static void open_input (void) {
+#if HAVE_SYS_MMAN_H
+  struct stat st;
+  off_t start = lseek (0, 0, SEEK_CUR);
+
+  if (fstat (0, &st) == 0 && S_ISREG (st.st_mode) &&
+      start >= 0 && start < st.st_size) {
+    void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+    if (map != MAP_FAILED) {
+      input.data = map;
+      input.len = st.st_size;
+      input.pos = start;
+      input.eof = true;
+    }
+  }
+#endif
+}
+
+/* Make at least n bytes available at input.data + input.pos unless the
+   input ends first, and return the number of bytes available. */
+static unsigned long fill (unsigned long n) {
+  while (input.len - input.pos < n && ! input.eof) {
+    ssize_t len;
+
+    if (input.pos) {
+      memmove (input.buffer, input.buffer + input.pos, input.len - input.pos);
+      input.len -= input.pos;
+      input.pos = 0;
+    }
+    grow_buffer (&input.buffer, &input.reserved,
+		 input.len + (n > INPUT_BLOCK_SIZE ? n : INPUT_BLOCK_SIZE));
+    input.data = input.buffer;
+    len = read (0, input.buffer + input.len, input.reserved - input.len);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      input.eof = true;
+    else
+      input.len += len;
+  }
+  return input.len - input.pos;
+}
+
+static int next_byte (void) {
+  if (input.pos == input.len && ! fill (1))
+    return EOF;
+  return input.data[input.pos++];
+}
+
 struct command {
   unsigned char type[COMMAND_STACK_SIZE];
   unsigned char data[COMMAND_STACK_SIZE];
@@ -97,7 +314,7 @@ struct command command;
 static void check_command_stack_overflow (void) {
   if (command.len >= array_size (command.data)) {
     print_message (ERROR, "Command stack overflow");
-    exit (1);
+    finish (1);
   }
 }
 
@@ -191,7 +408,7 @@ static void die (void) {
   unsigned int lines = 5;
 
   for (;;) {
-    int c = getchar ();
+    int c = next_byte ();
     if (command.len == HEX_CHUNK_SIZE) {
       char text[HEX_CHUNK_SIZE + 1];
       unsigned int n;
@@ -218,13 +435,13 @@ static void die (void) {
     }
     push (DATA, c);
   }
-  exit (1);
+  finish (1);
 }
 
 static int get (enum data_type type) {
   int c;
 
-  c = getchar ();
+  c = next_byte ();
   if (c == EOF) {
     if (command.len) {
       print_message (ERROR, "More data expected");
@@ -244,6 +461,7 @@ static const unsigned char *get_more (enum data_type type, unsigned int n) {
 }
 
 static void mark_error (unsigned int start, unsigned int len) {
+  summary.error_bytes += len;
   while (len-- != 0)
     command.type [start++] |= ERROR_FLAG;
 }
@@ -259,38 +477,37 @@ enum compression_mode {
   TIFF
 };
 
-static void grow_buffer (unsigned char **buffer, unsigned long *reserved, unsigned long min_size) {
-  unsigned char *new_buffer;
-  unsigned int new_size;
-
-  if (min_size <= *reserved)
-    return;
-  if (*reserved)
-    new_size = *reserved << 1;
-  else
-    new_size = 64;
-  while (new_size < min_size)
-    new_size <<= 1;
-  new_buffer = realloc (*buffer, new_size);
-  if (! new_buffer) {
-    fprintf(stderr, "Out of memory\n");
-    exit (1);
-  }
-  *buffer = new_buffer;
-  *reserved = new_size;
-}
-
+/*
+ * Rows are kept in buffer until IMAGE_SPILL_SIZE bytes have been
+ * collected, and are then appended to the spill file, so that long
+ * jobs do not need to be held in memory.
+ */
 struct image {
   int row_size;
   unsigned char *buffer;
   unsigned long size;
   unsigned long reserved;
   unsigned int blank_rows;
+  FILE *spill;
+  unsigned long spilled;
 };
 struct image image = {
   -1,
 };
 
+static void spill_rows (void) {
+  if (! image.spill)
+    image.spill = tmpfile ();
+  if (! image.spill ||
+      fwrite (image.buffer, 1, image.size, image.spill) != image.size) {
+    fprintf(stderr, "Cannot write raster data to temporary file: %s\n",
+	    strerror (errno));
+    exit (1);
+  }
+  image.spilled += image.size;
+  image.size = 0;
+}
+
 static void add_row (const unsigned char *row, int row_size) {
   if (image.row_size == -1) {
     if (! row || row_size == -1) {
@@ -299,6 +516,8 @@ static void add_row (const unsigned char *row, int row_size) {
     }
     image.row_size = row_size;
   }
+  if (image.size && image.size + image.row_size > IMAGE_SPILL_SIZE)
+    spill_rows ();
   grow_buffer (&image.buffer, &image.reserved, image.size + image.row_size);
   if (! row || row_size == -1) {
     memset (image.buffer + image.size, 0, image.row_size);
@@ -317,10 +536,71 @@ static void add_row (const unsigned char *row, int row_size) {
   image.size += image.row_size;
 }
 
+unsigned char *decompressed;
+unsigned long decompressed_reserved;
+
+/* Decode a TIFF compressed raster line in bulk.  Returns false for a
+   malformed line, which is then explained byte by byte. */
+static bool decode_tiff_line (const unsigned char *d, unsigned int bytes,
+			      unsigned int *decoded_size) {
+  unsigned int row_size = 0;
+  unsigned int n;
+
+  for (n = 0; n < bytes; ) {
+    signed char c = d[n];
+    if (c < 0) {
+      if (n + 2 > bytes)
+	return false;
+      row_size += 1 - c;
+      n += 2;
+    } else {
+      if (n + c + 2 > bytes)
+	return false;
+      row_size += c + 1;
+      n += c + 2;
+    }
+  }
+  *decoded_size = row_size;
+  if (! write_prefix)
+    return true;
+  grow_buffer (&decompressed, &decompressed_reserved, row_size);
+  for (n = 0, row_size = 0; n < bytes; ) {
+    signed char c = d[n];
+    if (c < 0) {
+      memset (decompressed + row_size, d[n + 1], 1 - c);
+      row_size += 1 - c;
+      n += 2;
+    } else {
+      memcpy (decompressed + row_size, d + n + 1, c + 1);
+      row_size += c + 1;
+      n += c + 2;
+    }
+  }
+  add_row (decompressed, row_size);
+  return true;
+}
+
 static void explain_raster_line (unsigned int bytes, enum compression_mode compression_mode) {
+  /* Only verbose mode shows the data, so it is not pushed otherwise */
+  if (! verbose && fill (bytes) >= bytes) {
+    const unsigned char *d = input.data + input.pos;
+    unsigned int row_size;
+
+    if (compression_mode != TIFF) {
+      if (write_prefix)
+	add_row (d, bytes);
+      summary_row (bytes);
+      input.pos += bytes;
+      return;
+    }
+    if (decode_tiff_line (d, bytes, &row_size)) {
+      summary_row (row_size);
+      input.pos += bytes;
+      return;
+    }
+  }
+
   if (compression_mode == TIFF) {
-    static unsigned char *decompressed;
-    static unsigned long reserved = 0;
     unsigned int row_size = 0, span;
     unsigned int n = 0;
 
@@ -333,7 +613,7 @@ static void explain_raster_line (unsigned int bytes, enum compression_mode compr
 	  die ();
 	}
 	span = 1 - (signed char) c;
-	grow_buffer (&decompressed, &reserved, row_size + span);
+	grow_buffer (&decompressed, &decompressed_reserved, row_size + span);
 	c = get (RASTER);
 	n++;
 	while (span--) {
@@ -346,7 +626,7 @@ static void explain_raster_line (unsigned int bytes, enum compression_mode compr
 	  mark_error (n - 1, 1);
 	  die ();
 	}
-	grow_buffer (&decompressed, &reserved, row_size + span);
+	grow_buffer (&decompressed, &decompressed_reserved, row_size + span);
 	while (span--) {
 	  decompressed [row_size] = get (RASTER);
 	  row_size++;
@@ -356,12 +636,14 @@ static void explain_raster_line (unsigned int bytes, enum compression_mode compr
     }
     if (write_prefix)
       add_row (decompressed, row_size);
+    summary_row (row_size);
     if (verbose)
       print_command ("(%d bytes)", row_size);
   } else {
     const unsigned char *d = get_more (RASTER, bytes);
     if (write_prefix)
       add_row (d, bytes);
+    summary_row (bytes);
     if (verbose)
       print_command (NULL);
   }
@@ -381,16 +663,22 @@ static char *next_filename (void) {
   return filename;
 }
 
+static void write_rows (png_structp png_ptr, unsigned long size) {
+  while (size > 0) {
+    size -= image.row_size;
+    png_write_row (png_ptr, image.buffer + size);
+  }
+}
+
 static void write_image (void)
 {
   png_structp png_ptr;
   png_infop info_ptr;
   png_colorp palette;
-  unsigned int pos;
   char *filename;
   FILE *fp;
 
-  if (! write_prefix || ! image.size)
+  if (! write_prefix || (! image.size && ! image.spilled))
     return;
 
   filename = next_filename ();
@@ -398,9 +686,12 @@ static void write_image (void)
   png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   info_ptr = png_create_info_struct (png_ptr);
   png_init_io (png_ptr, fp);
+  if (compression_level >= 0)
+    png_set_compression_level (png_ptr, compression_level);
   png_set_IHDR (png_ptr, info_ptr,
 	        /* width */ image.row_size * 8,
-		/* height */ image.size / image.row_size + image.blank_rows,
+		/* height */ (image.spilled + image.size) / image.row_size
+			     + image.blank_rows,
 	        /* bit depth */ 1,
 		/* PNG_COLOR_TYPE_GRAY */ PNG_COLOR_TYPE_PALETTE,
 		PNG_INTERLACE_NONE,
@@ -411,16 +702,34 @@ static void write_image (void)
   palette[1].red = palette[1].green = palette[1].blue = 0;
   png_set_PLTE(png_ptr, info_ptr, palette, 2);
   png_write_info (png_ptr, info_ptr);
-  pos = image.size;
-  while (pos > 0) {
-    pos -= image.row_size;
-    png_write_row (png_ptr, image.buffer + pos);
+  /* The rows are written bottom-up; spilled rows are read back from
+     the end of the spill file, one buffer at a time */
+  write_rows (png_ptr, image.size);
+  if (image.spilled) {
+    unsigned long chunk = IMAGE_SPILL_SIZE / image.row_size * image.row_size;
+    unsigned long pos = image.spilled;
+
+    grow_buffer (&image.buffer, &image.reserved, chunk);
+    while (pos > 0) {
+      unsigned long len = pos < chunk ? pos : chunk;
+
+      pos -= len;
+      if (fseeko (image.spill, pos, SEEK_SET) != 0 ||
+	  fread (image.buffer, 1, len, image.spill) != len) {
+	fprintf(stderr, "Cannot read raster data from temporary file: %s\n",
+		strerror (errno));
+	exit (1);
+      }
+      write_rows (png_ptr, len);
+    }
+    fclose (image.spill);
+    image.spill = NULL;
+    image.spilled = 0;
   }
   if (image.blank_rows) {
-    unsigned char *blank_row = malloc (image.row_size);
-    memset (blank_row, 0, image.row_size);
+    memset (image.buffer, 0, image.row_size);
     while (image.blank_rows--)
-      png_write_row (png_ptr, blank_row);
+      png_write_row (png_ptr, image.buffer);
     image.blank_rows = 0;
   }
   png_write_end (png_ptr, NULL);
@@ -546,15 +855,16 @@ static void explain (void) {
     c = get (CONTROL);
     if (c == EOF)
       break;
+    summary.commands++;
 
     if (c == 0) {
       int n = 1;
-      while ((c = getchar ()) == 0)
+      while ((c = next_byte ()) == 0)
 	n++;
       print_command ("Reset (%u)", n);
       if (c == EOF)
 	break;
-      ungetc (c, stdin);
+      input.pos--;
       initialized = false;
       continue;
     }
@@ -691,12 +1001,35 @@ static void explain (void) {
 	  print_command ("Legacy hires");
 	  break;
 
+	case 'D':  /* ESC i D */
+	  c = get (DATA);
+	  print_command ("Print density %u", c);
+	  break;
+
 	default:
 	  unknown_command ();
 	  break;
 	}
 	break;
 
+      case '*':  /* ESC * ' */
+	/* Bit image graphics, 24 dots (3 bytes) per column (PT-PC) */
+	if (get (CONTROL) != 0x27)
+	  unknown_command ();
+	d = get_more (DATA, 2);
+	u = d[0] + (d[1] << 8);
+	summary.raster_lines += u;
+	print_noisy_command ("Bit image graphics (%u columns)", u);
+	while (u--)
+	  explain_raster_line (3, UNCOMPRESSED);
+	break;
+
+      case 'J':  /* ESC J */
+	/* Advance across the tape, to the next bit image strip (PT-PC) */
+	c = get (DATA);
+	print_command ("Advance %u dots", c);
+	break;
+
       case EOF:
         break;
 
@@ -705,15 +1038,21 @@ static void explain (void) {
       }
       break;
 
+    case 0x0d:  /* Carriage Return */
+      print_command ("Carriage return");
+      break;
+
     case 'M':  /* M */
       c = get (DATA);
       switch (c) {
       case 0:
 	compression_mode = UNCOMPRESSED;
+	summary.compression |= 1 << UNCOMPRESSED;
         what = " (no compression)";
 	break;
       case 2:
 	compression_mode = TIFF;
+	summary.compression |= 1 << TIFF;
         what = " (TIFF)";
 	break;
       default:
@@ -734,6 +1073,7 @@ static void explain (void) {
       } else
 	u = d[0] + (d[1] << 8);
       check_compression_mode (&compression_mode);
+      summary.raster_lines++;
       print_noisy_command ("Raster graphics transfer (%u bytes)", u);
       explain_raster_line (u, compression_mode);
       break;
@@ -749,17 +1089,23 @@ static void explain (void) {
 	}
 	mark_error (0, 1);
       }
+      summary.zero_lines++;
+      summary_row (-1);
       print_noisy_command ("Zero raster graphics%s", what);
       add_row (NULL, -1);
       break;
 
     case 0x0c:  /* Form Feed */
       print_command ("Print command");
+      summary.pages++;
+      summary_image_end ();
       write_image ();
       break;
 
     case CTRL_Z: /* ^Z */
       print_command ("End of job");
+      summary.jobs++;
+      summary_image_end ();
       initialized = false;
       write_image ();
       break;
@@ -772,6 +1118,7 @@ static void explain (void) {
 
   if (initialized)
     print_message (ERROR, "End of job command missing");
+  summary_image_end ();
 }
 
 const char *progname;
@@ -780,11 +1127,19 @@ static void usage (int status) {
   FILE *file = status ? stderr : stdout;
 
   fprintf (file,
-	   "Usage: %s [OPTIONS]\n"
+	   "Usage: %s [OPTIONS] [FILE...]\n"
+	   "Explains the FILEs, or standard input if there are none.\n"
 	   "Options are:\n"
-	   "  -i, --input=NAME     file to read from (instead of standard input)\n"
+	   "  -i, --input=NAME     file to read from before the FILEs\n"
+	   "  -j, --jobs=N         explain up to N files at the same time\n"
+	   "      --summary={json,tsv}\n"
+	   "                       show a summary line for each file instead\n"
+	   "                       of the commands\n"
 #if HAVE_LIBPNG
-	   "  -w, --write=PREFIX   write raster data to PREFIXn.png\n"
+	   "  -w, --write=PREFIX   write raster data to PREFIXn.png, or to\n"
+	   "                       PREFIXm-n.png for the m-th of several files\n"
+	   "  -z, --compression=LEVEL\n"
+	   "                       zlib compression level of the PNG files (0-9)\n"
 #endif
 	   "  -s, --silent         hide raster graphics commands\n"
 	   "  -v, --verbose        show all commands and all data\n"
@@ -801,20 +1156,145 @@ static struct option long_options[] = {
   { "verbose",     no_argument,       NULL, 'v' },
 #if HAVE_LIBPNG
   { "write",       required_argument, NULL, 'w' },
+  { "compression", required_argument, NULL, 'z' },
 #endif
+  { "jobs",        required_argument, NULL, 'j' },
+  { "summary",     required_argument, NULL, 'S' },
   { "color",       required_argument, NULL, 'c' },
   { "help",        no_argument,       NULL, 'h' },
   { }
 };
 
+/* Explain a file, or standard input if name is NULL, and exit. */
+static void explain_file (const char *name) {
+  if (name) {
+    int fd = open (name, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "%s: %s\n", name, strerror (errno));
+      summary_name = name;
+      finish (1);
+    }
+    dup2 (fd, 0);
+    close (fd);
+    summary_name = name;
+  }
+  open_input ();
+
+  if (summary_format) {
+    /* The commands are explained for their counts only */
+    summary_file = fdopen (dup (1), "w");
+    if (! summary_file || ! freopen ("/dev/null", "w", stdout)) {
+      fprintf(stderr, "%s\n", strerror (errno));
+      exit (1);
+    }
+  }
+  explain ();
+  finish (0);
+}
+
+struct worker {
+  pid_t pid;
+  FILE *output;
+  int status;
+  bool done;
+};
+
+/*
+ * Explain files in worker processes, up to jobs at the same time.
+ * The output of each file is shown in the order of the files.
+ */
+static int explain_files (char **names, int count, int jobs) {
+  struct worker *workers = calloc (count, sizeof (*workers));
+  int next = 0, running = 0, shown = 0;
+  int status = 0;
+
+  if (! workers) {
+    fprintf(stderr, "Out of memory\n");
+    exit (1);
+  }
+  print_summary_header (stdout);
+  while (shown < count) {
+    while (running < jobs && next < count) {
+      struct worker *worker = workers + next;
+      const char *prefix = write_prefix;
+
+      worker->output = tmpfile ();
+      if (! worker->output) {
+	fprintf(stderr, "Cannot create temporary file: %s\n",
+		strerror (errno));
+	exit (1);
+      }
+      fflush (stdout);
+      worker->pid = fork ();
+      if (worker->pid == 0) {
+	if (prefix) {
+	  char *buffer;
+	  if (asprintf (&buffer, "%s%u-", prefix, next + 1) < 0)
+	    exit (1);
+	  write_prefix = buffer;
+	}
+	dup2 (fileno (worker->output), 1);
+	explain_file (names[next]);
+      }
+      if (worker->pid < 0) {
+	fprintf(stderr, "Cannot start worker: %s\n", strerror (errno));
+	exit (1);
+      }
+      next++;
+      running++;
+    }
+
+    int wstatus;
+    pid_t pid = wait (&wstatus);
+    if (pid < 0) {
+      fprintf(stderr, "%s\n", strerror (errno));
+      exit (1);
+    }
+    int n;
+    for (n = shown; n < next; n++) {
+      if (workers[n].pid == pid && ! workers[n].done) {
+	workers[n].done = true;
+	workers[n].status = WIFEXITED (wstatus) ? WEXITSTATUS (wstatus) : 1;
+	running--;
+	break;
+      }
+    }
+
+    for (; shown < count && workers[shown].done; shown++) {
+      struct worker *worker = workers + shown;
+      char buffer[BUFSIZ];
+      size_t len;
+
+      if (summary_format == NO_SUMMARY)
+	printf ("%s==> %s <==\n", shown ? "\n" : "", names[shown]);
+      fflush (stdout);
+      rewind (worker->output);
+      bool empty = true;
+      while ((len = fread (buffer, 1, sizeof (buffer), worker->output)) > 0) {
+	fwrite (buffer, 1, len, stdout);
+	empty = false;
+      }
+      /* A worker that failed before writing a summary gets an empty one */
+      if (empty && summary_format)
+	print_summary (stdout, names[shown], worker->status);
+      fclose (worker->output);
+      if (worker->status > status)
+	status = worker->status;
+    }
+  }
+  free (workers);
+  return status;
+}
+
 int main(int argc, char *argv[]) {
   const char *filename = NULL;
   bool use_colors = isatty (1);
   const char *options;
+  long jobs = sysconf (_SC_NPROCESSORS_ONLN);
 
   progname = basename (argv [0]);
 
-  options = "w:i:svh" + (HAVE_LIBPNG ? 0 : 2);
+  options = "w:z:i:j:svh" + (HAVE_LIBPNG ? 0 : 4);
 
   for (;;) {
     char c = getopt_long (argc, argv, options, long_options, NULL);
@@ -839,6 +1319,27 @@ int main(int argc, char *argv[]) {
         write_prefix = optarg;
 	break;
 
+      case 'z':  /* --compression */
+	if (optarg[0] < '0' || optarg[0] > '9' || optarg[1])
+	  usage (2);
+	compression_level = optarg[0] - '0';
+	break;
+
+      case 'j':  /* --jobs */
+	jobs = strtol (optarg, NULL, 10);
+	if (jobs < 1)
+	  usage (2);
+	break;
+
+      case 'S':  /* --summary */
+	if (strcmp (optarg, "json") == 0)
+	  summary_format = SUMMARY_JSON;
+	else if (strcmp (optarg, "tsv") == 0)
+	  summary_format = SUMMARY_TSV;
+	else
+	  usage (2);
+	break;
+
       case 'c':  /* --color */
 	if (strcmp (optarg, "always") == 0)
 	  use_colors = true;
@@ -858,15 +1359,6 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (filename) {
-    int fd = open (filename, O_RDONLY);
-    if (fd < 0) {
-      fprintf(stderr, "%s: %s\n", filename, strerror (errno));
-      exit (1);
-    }
-    dup2 (fd, 0);
-  }
-
   if (! use_colors) {
     int n;
     for (n = 0; n < array_size (colors); n++) {
@@ -877,6 +1369,14 @@ int main(int argc, char *argv[]) {
     colors[FLAG_CLEARED].off = "]";
   }
 
-  explain ();
+  /* The FILEs follow the --input file */
+  if (filename)
+    argv[--optind] = (char *) filename;
+  if (argc - optind > 1)
+    return explain_files (argv + optind, argc - optind,
+			  jobs > 0 ? jobs : 1);
+  print_summary_header (stdout);
+  fflush (stdout);
+  explain_file (argv[optind]);
   return 0;
 }
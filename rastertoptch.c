@@ -60,12 +60,69 @@
  * @param Align=Right|Center     Pixel data alignment on tape [Right]
  * @param MediaType=Tape|Labels  Media Type
  * @param PrintDensity=1|...|5   Print density level: 1=light, 5=dark
- * @param ConcatPages            Output all pages in one page [noConcatPages]
+ * @param ConcatPages            Output all pages in one page; with
+ *                               LabelPreamble, the input is read twice
+ *                               to count the lines of all pages, and is
+ *                               spooled to a temporary file if it is
+ *                               not a regular file [noConcatPages]
  * @param SoftwareMirror         Make the filter mirror pixel data
  *                               if MirrorPrint is requested [noSoftwareMirror]
  * @param LabelPreamble          Emit preamble containing print quality,
  *                               roll/label type, tape width, label height,
  *                               and pixel lines [noLabelPreamble]
+ * @param BandHeight=N           Send pixel data to the printer every N
+ *                               lines instead of once per page; 0 means
+ *                               once per page [0]
+ * @param BufferSize=N           Maximum number of bytes of pixel data to
+ *                               hold back before sending it to the
+ *                               printer [1000000]
+ * @param Pipeline               Read input and write output in separate
+ *                               threads, overlapping with encoding
+ *                               [noPipeline]
+ * @param EncodeThreads=N        Transform and encode the lines of pages of
+ *                               at least ENCODE_THREADS_MIN_LINES lines
+ *                               in N threads; 0 or 1 means in the main
+ *                               thread only [0]
+ * @param StateFile=NAME         Record in file NAME whether the last job
+ *                               sent to the printer ended cleanly [none]
+ * @param IdleReset=N            Send only N NUL bytes instead of 350 to
+ *                               reset the printer at the start of the
+ *                               job if StateFile shows that the last
+ *                               job ended cleanly [350]
+ * @param StatusCheck            Request the printer status through the
+ *                               CUPS back channel at the start of the
+ *                               job, check the media width against the
+ *                               page width, and stop the job when the
+ *                               printer reports an error [noStatusCheck]
+ * @param AdaptiveCompression    For PT series printers with PixelXfer=RLE,
+ *                               send each band of pixel lines (see
+ *                               BandHeight) uncompressed if that takes
+ *                               fewer bytes than RLE; the printer must
+ *                               accept compression mode changes between
+ *                               bands [noAdaptiveCompression]
+ * @param BipStrips=N            With PixelXfer=BIP, print N strips of
+ *                               BytesPerLine (3) bytes side by side,
+ *                               each taking a pass over the page; the
+ *                               page must fit in BufferSize [1]
+ * @param Statistics             Include the time spent reading,
+ *                               transforming, encoding, flushing and
+ *                               writing in the job statistics
+ *                               [noStatistics]
+ *
+ * <h3>Daemon mode</h3>
+ * With --daemon=NAME, the filter serves any number of jobs on the
+ * UNIX socket NAME instead.  A client connects, sends the
+ * {job-options} string terminated by a newline, followed by the CUPS
+ * raster data, and shuts down its sending side.  The printer data is
+ * sent back on the connection, which is then closed.  Each job runs
+ * in a process of its own forked from the daemon, so jobs are
+ * isolated from each other as before, without the overhead of
+ * starting the filter.  Closing the connection cancels the job;
+ * SIGTERM cancels all jobs and stops the daemon.
+ *
+ * At the end of the job, job statistics are reported as a JSON object
+ * in a "DEBUG: rastertoptch: Statistics:" message, and written to the
+ * file given by the --stats option.
  *
  * Information about resolution, mirror print, negative
  * print, cut media, advance distance (feed) is extracted from the
@@ -190,10 +247,10 @@
  * narrow tapes require padding raster data with zero bits at the end.
  *
  * For PC-PT, only the central 24 pixels (= 3,4mm!) can be used for
- * pixel-based graphics.  It might be possible to print several strips
- * of 24 pixels side-by side by issuing CR and line-positioning
- * commands.  That is currently not supported, let alone attempted,
- * with this driver.
+ * pixel-based graphics in one pass.  With BipStrips=N, the driver
+ * prints N strips of 24 pixels side by side, separating the bit
+ * images of the strips by CR and "ESC J 24" (advance 24 dots).  This
+ * has not been tried on a printer yet.
  *
  * <table>
  * <tr><th>Model    <th>Cutter  <th>Xfer<th>DPI<th>Pixels<th>Bytes<th>Tape
@@ -274,8 +331,38 @@
 #include <cups/cups.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_SEMAPHORE_H)
+#include <pthread.h>
+#include <semaphore.h>
+#define HAVE_THREADS 1
+#ifdef HAVE_CUPSRASTEROPENIO
+#define HAVE_PIPELINE 1
+#endif
+#endif
+/** @def THREAD_LOCAL
+ * Storage class of data every encoder thread has its own copy of */
+#ifdef HAVE_THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+#if defined(HAVE_POLL_H) && defined(HAVE_SYS_SOCKET_H) \
+  && defined(HAVE_SYS_UN_H) && defined(HAVE_SYS_WAIT_H)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#define HAVE_DAEMON 1
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#define HAVE_RASTER_MAP 1
+#endif
 
 static const char* progname;
 
@@ -288,6 +375,10 @@ static const char* progname;
 
 /** ASCII escape value */
 #define ESC 0x1b
+/** ASCII carriage return value */
+#define CR 0x0d
+/** Bytes per bit image column (24 dots) */
+#define BIP_COLUMN_BYTES 3
 
 /**
  * Pixel transfer mode type.
@@ -305,9 +396,15 @@ typedef enum {RIGHT, CENTER} align_t;
 typedef enum {TAPE, LABELS} media_t;
 
 /** CUPS Raster line buffer.                             */
-unsigned char* buffer;
+unsigned char* buffer = NULL;
+/** CUPS Raster line buffer holding the previous line.   */
+unsigned char* prev_buffer = NULL;
+/** Size of buffer and prev_buffer.                      */
+size_t buffer_alloced = 0;
 /** Buffer holding line data to emit to the printer.     */
-unsigned char* emit_line_buffer;
+unsigned char* emit_line_buffer = NULL;
+/** Size of emit_line_buffer.                            */
+size_t emit_line_buffer_alloced = 0;
 /** Buffer holding RLE line data to emit to the printer. */
 unsigned char* rle_buffer = NULL;
 /** Pointer to first free pos in rle_buffer.             */
@@ -320,32 +417,661 @@ int empty_lines = 0;
 unsigned lines_waiting = 0;
 /** Threshold for flushing waiting lines to printer.     */
 unsigned max_lines_waiting = INT_MAX;
+/** Number of pixel lines in the current page, or in all pages if
+ *  ConcatPages pages were counted ahead (see counted_pages). */
+unsigned page_lines = 0;
+/** Number of pages of a ConcatPages job counted ahead of the job by
+ *  count_concat_lines (0 = not counted).                */
+unsigned counted_pages = 0;
+/** Whether the label preamble announces page_lines ahead of the first
+ *  line of the page, rather than the lines flushed at the page end. */
+bool preamble_up_front = false;
+/** Whether the label preamble of the current page has been emitted. */
+bool preamble_emitted = false;
+/** Compression mode the printer was set to for AdaptiveCompression in
+ *  the current page (-1 = not set yet).                 */
+int wire_compression = -1;
+/** Whether ULP lines are sent right away instead of via rle_buffer. */
+bool ulp_direct = false;
+/** Whether the printer is known to be idle at the start of the job. */
+bool printer_idle = false;
+/** Whether the printer reset has been emitted.          */
+bool printer_reset = false;
+/** Raster files read one after the other as the pages of one job,
+ *  or NULL if the job is read from standard input only.  */
+char** batch_inputs = NULL;
+/** Number of files in batch_inputs.                     */
+unsigned batch_ninputs = 0;
+/** Index of the next file in batch_inputs to read.      */
+unsigned batch_next = 0;
+/** Empty ULP line: command prefix followed by bytes of xormask.   */
+unsigned char ulp_empty_line [3 + 0xff];
+/** XOR mask ulp_empty_line was generated for (-1 = not generated). */
+int ulp_empty_xormask = -1;
+/** Empty RLE line: 'Z', or an encoded line of bytes of xormask. */
+unsigned char rle_empty_line [3 + 2 * ((0xff + 128) / 129)];
+/** Length of rle_empty_line.                            */
+unsigned rle_empty_len = 0;
+/** XOR mask rle_empty_line was generated for (-1 = not generated). */
+int rle_empty_xormask = -1;
+/** Last line stored by RLE_store_line, in the form it was stored. */
+unsigned char rle_last_line [4 + 0xff + 0xff / 128];
+/** Length of rle_last_line.                             */
+unsigned rle_last_line_len = 0;
+
+/** Maximum value of the EncodeThreads option.           */
+#define ENCODE_THREADS_MAX 64
+/** Pages with fewer lines than this are encoded by the main thread
+ *  only, whatever the EncodeThreads option.             */
+#define ENCODE_THREADS_MIN_LINES 2048
+/** Number of lines an encoder thread encodes at a time. */
+#define ENCODE_BATCH_LINES 256
+
+/** Size of the printer output buffer.                   */
+#define OUTPUT_BUFFER_SIZE 0x10000
+/** Buffer holding printer command bytes not yet written. */
+unsigned char output_buffer [OUTPUT_BUFFER_SIZE];
+/** Number of bytes waiting in output_buffer.            */
+unsigned output_len = 0;
+
+/** Maximum number of encoded pages kept in the page cache. */
+#define PAGE_CACHE_ENTRIES 8
+/** Maximum total size of the encoded pages in the page cache. */
+#define PAGE_CACHE_MAX_BYTES 0x1000000
+/** Maximum size of the raster data of a cached page.    */
+#define PAGE_CACHE_MAX_RASTER 0x1000000
+/** Maximum number of label preambles in a cached page.  */
+#define PAGE_CACHE_MAX_PREAMBLES 16
+
+/**
+ * Printer data emitted for a page, kept for emitting identical pages.
+ */
+typedef struct {
+  cups_page_header2_t header; /**< Page header                      */
+  uint64_t hash;              /**< Hash of the raster data          */
+  unsigned char* data;        /**< Printer data, without page end   */
+  size_t len;                 /**< Length of data                   */
+  unsigned preambles;         /**< Number of label preambles in data */
+  /** Offsets of the which_page bytes of the label preambles in data */
+  size_t which_page [PAGE_CACHE_MAX_PREAMBLES];
+  int last_use;               /**< Page last emitted from the entry */
+} page_cache_entry_t;
+
+/** Page cache entries (data == NULL = unused).          */
+page_cache_entry_t page_cache [PAGE_CACHE_ENTRIES];
+/** Total size of the printer data in page_cache.        */
+size_t page_cache_bytes = 0;
+/** Hash of the raster data of the current page.         */
+uint64_t page_hash;
+/** Whether the current page can be stored in page_cache. */
+bool page_cacheable = false;
+/** Raster data of the current page read ahead to look it up in
+ *  page_cache, or NULL if the raster data is read as it is used. */
+const unsigned char* page_raster = NULL;
+/** Buffer for page_raster, kept for reuse.              */
+unsigned char* page_raster_buffer = NULL;
+/** Size of page_raster_buffer.                          */
+size_t page_raster_alloced = 0;
+/** Length of page_raster.                               */
+size_t page_raster_len = 0;
+/** Position of the next line in page_raster.            */
+size_t page_raster_pos = 0;
+/** Raster input mapped into memory, or NULL if the raster data is
+ *  read through libcups.                                 */
+const unsigned char* raster_map = NULL;
+/** Length of raster_map.                                */
+size_t raster_map_len = 0;
+/** Position of the next byte to read in raster_map.     */
+size_t raster_map_pos = 0;
+/** Whether the printer data written is being recorded.  */
+bool page_recording = false;
+/** Page cache entry receiving the recorded printer data. */
+page_cache_entry_t page_record;
+/** Size of page_record.data.                            */
+size_t page_record_alloced = 0;
+
+/**
+ * Stages of the filter that the job statistics account time to.
+ */
+typedef enum {
+  STAGE_OTHER,     /**< Commands and page handling           */
+  STAGE_READ,      /**< Reading raster data                  */
+  STAGE_TRANSFORM, /**< Generating pixel lines               */
+  STAGE_ENCODE,    /**< Storing pixel lines (RLE encoding)   */
+  STAGE_FLUSH,     /**< Flushing stored pixel lines          */
+  STAGE_WRITE,     /**< Writing printer data                 */
+  STAGES
+} stage_t;
+
+/** Names of the stages in the job statistics.           */
+static const char* stage_names [STAGES] = {
+  "other", "read", "transform", "encode", "flush", "write"
+};
+
+/**
+ * Job statistics.
+ */
+typedef struct {
+  double start;                 /**< Time the job started             */
+  double first_byte;            /**< Time the first printer data was
+                                     written, or 0                    */
+  double stage_time [STAGES];   /**< Time spent in each stage         */
+  stage_t stage;                /**< Current stage                    */
+  double stage_start;           /**< Time the current stage started   */
+  unsigned long pages;          /**< Pages emitted                    */
+  unsigned long cached_pages;   /**< Pages emitted from page_cache    */
+  unsigned long raster_lines;   /**< Raster lines read                */
+  unsigned long pixel_lines;    /**< Pixel lines stored               */
+  unsigned long empty_lines;    /**< Pixel lines stored as empty      */
+  unsigned long repeated_lines; /**< Pixel lines stored as repeated   */
+  unsigned long long raster_bytes;  /**< Raster bytes read            */
+  unsigned long long pixel_bytes;   /**< Bytes of pixel lines stored  */
+  unsigned long long encoded_bytes; /**< Bytes the pixel lines were
+                                         stored in                    */
+  unsigned long long output_bytes;  /**< Printer data bytes written   */
+  long long saved_bytes;            /**< Bytes saved by sending bands
+                                         uncompressed, less the mode
+                                         changes (may be negative)    */
+  unsigned long rle_reallocs;   /**< Times rle_buffer grew            */
+} job_stats_t;
+
+/** Statistics of the current job.                       */
+job_stats_t stats;
+/** Whether time is accounted to stages (Statistics option). */
+bool stats_timing = false;
+
+/**
+ * Read the monotonic clock.
+ * @return  Time in seconds
+ */
+static inline double
+monotonic_time (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Switch the stage the job statistics account time to.
+ * @param stage  New stage
+ * @return       Previous stage, to switch back to
+ */
+static inline stage_t
+stats_enter (stage_t stage) {
+  stage_t prev = stats.stage;
+  if (stats_timing) {
+    double now = monotonic_time ();
+    stats.stage_time [prev] += now - stats.stage_start;
+    stats.stage_start = now;
+  }
+  stats.stage = stage;
+  return prev;
+}
+
+/**
+ * Write the job statistics as a JSON object, on one line.
+ * @param f  Stream to write to
+ */
+static void
+stats_write_json (FILE* f) {
+  double now = monotonic_time ();
+  fprintf (f, "{\"pages\": %lu, \"cached_pages\": %lu, "
+	   "\"raster_lines\": %lu, \"pixel_lines\": %lu, "
+	   "\"empty_lines\": %lu, \"repeated_lines\": %lu, "
+	   "\"raster_bytes\": %llu, \"encoded_bytes\": %llu, "
+	   "\"output_bytes\": %llu, \"saved_bytes\": %lld, "
+	   "\"rle_reallocs\": %lu, ",
+	   stats.pages, stats.cached_pages,
+	   stats.raster_lines, stats.pixel_lines,
+	   stats.empty_lines, stats.repeated_lines,
+	   stats.raster_bytes, stats.encoded_bytes,
+	   stats.output_bytes, stats.saved_bytes, stats.rle_reallocs);
+  fprintf (f, "\"empty_line_ratio\": %.4f, \"compression_ratio\": %.4f, "
+	   "\"time\": %.6f, \"time_to_first_byte\": %.6f",
+	   stats.pixel_lines
+	   ? (double) stats.empty_lines / stats.pixel_lines : 0.0,
+	   stats.encoded_bytes
+	   ? (double) stats.pixel_bytes / stats.encoded_bytes : 0.0,
+	   now - stats.start,
+	   stats.first_byte ? stats.first_byte - stats.start : 0.0);
+  if (stats_timing) {
+    stats_enter (stats.stage);
+    int i;
+    fprintf (f, ", \"stage_time\": {");
+    for (i = 0; i < STAGES; i++)
+      fprintf (f, "%s\"%s\": %.6f", i ? ", " : "",
+	       stage_names [i], stats.stage_time [i]);
+    fprintf (f, "}");
+  }
+  fprintf (f, "}\n");
+}
+
+/**
+ * Add printer data being written to the page recording.  A page
+ * producing more data than can be cached is not recorded.
+ * @param data  Data written
+ * @param len   Length of data
+ */
+static void
+page_record_append (const unsigned char* data, size_t len) {
+  if (page_record.len + len > PAGE_CACHE_MAX_BYTES) {
+    page_recording = false;
+    return;
+  }
+  if (page_record.len + len > page_record_alloced) {
+    size_t new_alloced = page_record_alloced * 2 + 0x4000;
+    if (new_alloced < page_record.len + len)
+      new_alloced = page_record.len + len;
+    unsigned char* new_data = realloc (page_record.data, new_alloced);
+    if (!new_data) {
+      page_recording = false;
+      return;
+    }
+    page_record.data = new_data;
+    page_record_alloced = new_alloced;
+  }
+  memcpy (page_record.data + page_record.len, data, len);
+  page_record.len += len;
+}
+
+#ifdef HAVE_THREADS
+/**
+ * Wait for a semaphore, ignoring interruptions by signals.
+ * @param sem  Semaphore
+ */
+static void
+semaphore_wait (sem_t* sem) {
+  while (sem_wait (sem) != 0 && errno == EINTR)
+    ;
+}
+
+/**
+ * Start a thread with all signals blocked, so that signals such as
+ * SIGTERM (see cancel_job) is handled by the main thread.
+ * @param thread  Returns the thread
+ * @param func    Thread function
+ * @param arg     Thread function argument
+ * @return        0 on success, an error number otherwise
+ */
+static int
+start_thread (pthread_t* thread, void* (*func) (void*), void* arg) {
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  int err = pthread_create (thread, NULL, func, arg);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  return err;
+}
+#endif /* HAVE_THREADS */
+
+#ifdef HAVE_PIPELINE
+/** Number of blocks in a pipeline ring buffer.          */
+#define RING_BLOCKS 8
+/** Size of a block in a pipeline ring buffer.           */
+#define RING_BLOCK_SIZE 0x10000
+
+/**
+ * Ring buffer of data blocks connecting two pipeline stages, with a
+ * single producer and a single consumer.  Only the producer changes
+ * head, and only the consumer changes tail; the semaphores count the
+ * filled and free blocks, and make the producer or consumer wait.
+ */
+typedef struct {
+  unsigned char data [RING_BLOCKS][RING_BLOCK_SIZE]; /**< Blocks     */
+  size_t len [RING_BLOCKS]; /**< Data in each block; 0 = end of data */
+  unsigned head;            /**< Next block to fill                  */
+  unsigned tail;            /**< Next block to drain                 */
+  sem_t filled;             /**< Number of filled blocks             */
+  sem_t empty;              /**< Number of free blocks               */
+  pthread_t thread;         /**< Thread running the other stage      */
+} ring_t;
+
+/** Ring buffer from the input reader thread.            */
+ring_t* input_ring = NULL;
+/** Ring buffer to the output writer thread.             */
+ring_t* output_ring = NULL;
+
+/**
+ * Allocate and initialise a ring buffer.
+ * @return  Ring buffer, or NULL if out of memory
+ */
+static ring_t*
+ring_new (void) {
+  ring_t* ring = malloc (sizeof (*ring));
+  if (!ring)
+    return NULL;
+  ring->head = ring->tail = 0;
+  sem_init (&ring->filled, 0, 0);
+  sem_init (&ring->empty, 0, RING_BLOCKS);
+  return ring;
+}
+
+/**
+ * Get the next block to fill, waiting until one is free.
+ * @param ring  Ring buffer
+ * @return      Block, RING_BLOCK_SIZE bytes
+ */
+static unsigned char*
+ring_put_begin (ring_t* ring) {
+  semaphore_wait (&ring->empty);
+  return ring->data [ring->head];
+}
+
+/**
+ * Hand the block returned by ring_put_begin to the consumer.
+ * @param ring  Ring buffer
+ * @param len   Number of bytes filled in; 0 marks the end of the data
+ */
+static void
+ring_put_end (ring_t* ring, size_t len) {
+  ring->len [ring->head] = len;
+  ring->head = (ring->head + 1) % RING_BLOCKS;
+  sem_post (&ring->filled);
+}
+
+/**
+ * Get the next filled block, waiting until there is one.
+ * @param ring  Ring buffer
+ * @param len   Returns the number of bytes in the block
+ * @return      Block
+ */
+static unsigned char*
+ring_get_begin (ring_t* ring, size_t* len) {
+  semaphore_wait (&ring->filled);
+  *len = ring->len [ring->tail];
+  return ring->data [ring->tail];
+}
+
+/**
+ * Hand the block returned by ring_get_begin back to the producer.
+ * @param ring  Ring buffer
+ */
+static void
+ring_get_end (ring_t* ring) {
+  ring->tail = (ring->tail + 1) % RING_BLOCKS;
+  sem_post (&ring->empty);
+}
+#endif /* HAVE_PIPELINE */
+
+/** Minimum time between progress reports, in seconds.  */
+#define PROGRESS_INTERVAL 1.0
+/** Number of raster lines between checks whether progress is due. */
+#define PROGRESS_CHECK_LINES 256
 
+/**
+ * Progress of the current page, in pixel lines handed to the printer.
+ */
 struct progress {
-  unsigned int page;
-  unsigned int height;
-  unsigned int completed;
+  unsigned int page;          /**< Page number                        */
+  unsigned long lines;        /**< Pixel lines in the page            */
+  unsigned long delivered;    /**< Pixel lines written to the printer */
+  unsigned long buffered;     /**< Pixel lines in output_buffer, to be
+                                   delivered when it is written       */
+  double reported;            /**< Time of the last report            */
+  unsigned int reported_page; /**< Page of the last report            */
+  unsigned int reported_percent; /**< Percentage of the last report   */
 } progress;
 
-void report_progress (int signal) {
-  static struct progress old;
-  char buffer[64];
-  int len;
+/**
+ * Report the progress of the current page, if it has changed since the
+ * last report, and PROGRESS_INTERVAL has passed or force is set.
+ * @param force  Whether to report regardless of the time passed
+ */
+static void
+report_progress (bool force) {
+  double now = monotonic_time ();
+  if (!force && now - progress.reported < PROGRESS_INTERVAL)
+    return;
+  unsigned percent = 100;
+  /* Concatenated pages may deliver lines of the page before */
+  if (progress.delivered < progress.lines)
+    percent = progress.delivered * 100 / progress.lines;
+  if (progress.page == progress.reported_page
+      && percent == progress.reported_percent)
+    return;
+  progress.reported = now;
+  progress.reported_page = progress.page;
+  progress.reported_percent = percent;
+  fprintf (stderr, "INFO: printing page %u, %u%% done\n",
+	   progress.page, percent);
+}
+
+/**
+ * Write data to the printer (standard output) right away, retrying on
+ * short writes and interrupted system calls.
+ * @param data  Data to write
+ * @param len   Length of data
+ */
+static void
+output_write_fd (const unsigned char* data, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write (1, data, len);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf (stderr, "ERROR: Cannot write printer data: %s\n",
+	       strerror (errno));
+      exit (1);
+    }
+    data += ret;
+    len -= ret;
+  }
+}
 
-  if ((old.page == progress.page &&
-       old.completed == progress.completed) ||
-      progress.height == 0)
+/**
+ * Write data to the printer, through the output writer thread if
+ * there is one.
+ * @param data  Data to write
+ * @param len   Length of data
+ */
+static void
+output_write (const unsigned char* data, size_t len) {
+  if (len == 0)
     return;
-  old = progress;
+  if (page_recording)
+    page_record_append (data, len);
+  if (!stats.first_byte)
+    stats.first_byte = monotonic_time ();
+  stats.output_bytes += len;
+  stage_t prev_stage = stats_enter (STAGE_WRITE);
+#ifdef HAVE_PIPELINE
+  if (output_ring) {
+    /* Keep cancel_job from emitting data while the ring is updated */
+    sigset_t term, old;
+    sigemptyset (&term);
+    sigaddset (&term, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &term, &old);
+    while (len > 0) {
+      size_t n = len < RING_BLOCK_SIZE ? len : RING_BLOCK_SIZE;
+      memcpy (ring_put_begin (output_ring), data, n);
+      ring_put_end (output_ring, n);
+      data += n;
+      len -= n;
+    }
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+    stats_enter (prev_stage);
+    return;
+  }
+#endif
+  output_write_fd (data, len);
+  stats_enter (prev_stage);
+}
+
+/**
+ * Write all bytes waiting in the output buffer to the printer.
+ */
+static void
+output_flush (void) {
+  output_write (output_buffer, output_len);
+  output_len = 0;
+  progress.delivered += progress.buffered;
+  progress.buffered = 0;
+}
+
+/**
+ * Reserve space in the output buffer.
+ * @param bytes  Number of bytes to reserve; at most OUTPUT_BUFFER_SIZE
+ * @return       Pointer to the reserved bytes, which the caller must fill
+ */
+static inline unsigned char*
+output_reserve (unsigned bytes) {
+  if (output_len + bytes > OUTPUT_BUFFER_SIZE)
+    output_flush ();
+  unsigned char* p = output_buffer + output_len;
+  output_len += bytes;
+  return p;
+}
+
+/**
+ * Append data to the output buffer.  Large blocks of data bypass the
+ * buffer and are written directly.
+ * @param data  Data to append
+ * @param len   Length of data
+ */
+static inline void
+output_append (const void* data, size_t len) {
+  if (output_len + len > OUTPUT_BUFFER_SIZE) {
+    output_flush ();
+    if (len >= OUTPUT_BUFFER_SIZE) {
+      output_write (data, len);
+      return;
+    }
+  }
+  memcpy (output_buffer + output_len, data, len);
+  output_len += len;
+}
+
+/**
+ * Append a number of copies of a byte to the output buffer.
+ * @param c    Byte value
+ * @param len  Number of bytes to append
+ */
+static inline void
+output_memset (unsigned char c, size_t len) {
+  while (len > 0) {
+    if (output_len == OUTPUT_BUFFER_SIZE)
+      output_flush ();
+    size_t n = OUTPUT_BUFFER_SIZE - output_len;
+    if (n > len) n = len;
+    memset (output_buffer + output_len, c, n);
+    output_len += n;
+    len -= n;
+  }
+}
+
+/**
+ * Append a single byte to the output buffer.
+ * @param c  Byte value
+ */
+static inline void
+output_byte (unsigned char c) {
+  *output_reserve (1) = c;
+}
+
+/** @def output_cmd
+ * Append a printer command given as a list of byte values */
+#define output_cmd(...)						\
+  output_append ((const unsigned char []) { __VA_ARGS__ },	\
+		 sizeof ((const unsigned char []) { __VA_ARGS__ }))
+
+#ifdef HAVE_PIPELINE
+/** Block from input_ring being read.                    */
+unsigned char* input_block = NULL;
+/** Length of input_block.                               */
+size_t input_block_len = 0;
+/** Position of the next byte to read in input_block.    */
+size_t input_block_pos = 0;
+
+/**
+ * Output writer thread: write the blocks from output_ring to the
+ * printer until the end of the data.
+ * @param arg  Ring buffer
+ */
+static void*
+output_writer (void* arg) {
+  ring_t* ring = arg;
+  for (;;) {
+    size_t len;
+    unsigned char* block = ring_get_begin (ring, &len);
+    if (len == 0)
+      break;
+    output_write_fd (block, len);
+    ring_get_end (ring);
+  }
+  return NULL;
+}
+
+/**
+ * Input reader thread: read the input (standard input) into blocks of
+ * input_ring until the end of the input.
+ * @param arg  Ring buffer
+ */
+static void*
+input_reader (void* arg) {
+  ring_t* ring = arg;
+  ssize_t len;
+  do {
+    unsigned char* block = ring_put_begin (ring);
+    do
+      len = read (0, block, RING_BLOCK_SIZE);
+    while (len < 0 && errno == EINTR);
+    /* Read errors end the input, as they would for cupsRasterOpen */
+    ring_put_end (ring, len > 0 ? len : 0);
+  } while (len > 0);
+  return NULL;
+}
 
-  len = snprintf (buffer, sizeof (buffer),
-		  "INFO: printing page %u, %u%% done\n",
-		  progress.page,
-		  progress.completed * 100 / progress.height);
-  if (len > 0) {
-    if (write (2, buffer, len) != len)
-      /* ignore*/ ;
+/**
+ * Read input from input_ring; callback for cupsRasterOpenIO.
+ * @param ctx     Ring buffer
+ * @param buf     Buffer to read into
+ * @param len     Maximum number of bytes to read
+ * @return        Number of bytes read; 0 at end of input
+ */
+static ssize_t
+input_ring_read (void* ctx, unsigned char* buf, size_t len) {
+  ring_t* ring = ctx;
+  if (input_block_pos == input_block_len) {
+    if (input_block && input_block_len == 0)
+      return 0;  /* End of input already reached */
+    if (input_block)
+      ring_get_end (ring);
+    input_block = ring_get_begin (ring, &input_block_len);
+    input_block_pos = 0;
+    if (input_block_len == 0)
+      return 0;
+  }
+  size_t n = input_block_len - input_block_pos;
+  if (n > len) n = len;
+  memcpy (buf, input_block + input_block_pos, n);
+  input_block_pos += n;
+  return n;
+}
+#endif /* HAVE_PIPELINE */
+
+/**
+ * Write all output waiting in the output buffer and, for the Pipeline
+ * option, wait for the output writer thread to write it.
+ */
+void
+pipeline_close (void) {
+  output_flush ();
+#ifdef HAVE_PIPELINE
+  if (output_ring) {
+    /* Keep cancel_job from closing the pipeline a second time */
+    sigset_t term, old;
+    sigemptyset (&term);
+    sigaddset (&term, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &term, &old);
+    ring_t* ring = output_ring;
+    ring_put_begin (ring);
+    ring_put_end (ring, 0);
+    pthread_join (ring->thread, NULL);
+    output_ring = NULL;
+    free (ring);
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
   }
+#endif
 }
 
 /**
@@ -377,6 +1103,16 @@ typedef struct {
   float min_margin;     /**< minimum top and bottom margin        */
   float margin;         /**< top and bottom margin                */
   int status_notification; /**< automatic status notification     */
+  int band_height;      /**< lines per band (0 = whole page)      */
+  int buffer_size;      /**< maximum size of rle_buffer           */
+  bool pipeline;        /**< read and write in separate threads   */
+  bool statistics;      /**< account time to filter stages        */
+  bool adaptive_compression; /**< send bands uncompressed if shorter */
+  int encode_threads;   /**< threads encoding tall pages (0 = none) */
+  int bip_strips;       /**< bit image strips side by side        */
+  int idle_reset;       /**< reset bytes if the printer is idle   */
+  char state_file [256]; /**< file recording clean job ends (""=none) */
+  bool status_check;    /**< check printer status on back channel */
   unsigned int page;    /**< The current page number              */
   bool last_page;       /**< This is the last page                */
 } job_options_t;
@@ -415,6 +1151,16 @@ parse_job_options (const char* str) {
     /* min_margin */ 0.0,
     /* margin */ 0.0,
     /* status_notification (don't set) */ -1,
+    /* band_height */ 0,
+    /* buffer_size */ 1000000,
+    /* pipeline */ false,
+    /* statistics */ false,
+    /* adaptive_compression */ false,
+    /* encode_threads */ 0,
+    /* bip_strips */ 1,
+    /* idle_reset */ 350,
+    /* state_file */ "",
+    /* status_check */ false,
   };
 
   struct int_option {
@@ -430,6 +1176,11 @@ parse_job_options (const char* str) {
     { "LegacyTransferMode", &options.legacy_xfer_mode, 0, 255 },
     { "TransferMode", &options.xfer_mode, 0, 255 },
     { "StatusNotification", &options.status_notification, 0, 1 },
+    { "BandHeight", &options.band_height, 0, 65535 },
+    { "BufferSize", &options.buffer_size, 0x4000, INT_MAX },
+    { "IdleReset", &options.idle_reset, 0, 350 },
+    { "EncodeThreads", &options.encode_threads, 0, ENCODE_THREADS_MAX },
+    { "BipStrips", &options.bip_strips, 1, 255 / BIP_COLUMN_BYTES },
     { }
   };
 
@@ -438,6 +1189,7 @@ parse_job_options (const char* str) {
     bool *value;
   };
   struct bool_option bool_options [] = {
+    { "AdaptiveCompression", &options.adaptive_compression },
     { "AutoCut", &options.auto_cut },
     { "ChainPrinting", &options.chain_printing },
     { "ConcatPages", &options.concat_pages },
@@ -448,9 +1200,12 @@ parse_job_options (const char* str) {
     { "LastPageFlag", &options.last_page_flag },
     { "LegacyHires", &options.legacy_hires },
     { "MirrorPrint", &options.mirror_print },
+    { "Pipeline", &options.pipeline },
     { "PT", &options.pt_series },
     { "QL", &options.ql_series },
     { "SoftwareMirror", &options.software_mirror },
+    { "Statistics", &options.statistics },
+    { "StatusCheck", &options.status_check },
     { }
   };
 
@@ -543,6 +1298,18 @@ parse_job_options (const char* str) {
       continue;
     }
 
+    if (strcasecmp (name, "StateFile") == 0) {
+      if (value && *value && strlen (value) < sizeof (options.state_file)) {
+	strcpy (options.state_file, value);
+	continue;
+      }
+      fprintf (stderr, "ERROR: The value of %s must be a file name "
+	       "shorter than %d characters\n",
+	       name, (int) sizeof (options.state_file));
+      exit (2);
+      continue;
+    }
+
     struct int_option *int_option;
     for (int_option = int_options; int_option->name; int_option++) {
       if (strcasecmp (name, int_option->name) == 0) {
@@ -605,13 +1372,189 @@ parse_job_options (const char* str) {
 
   /* Release memory allocated for CUPS options struct */
   cupsFreeOptions (num_options, cups_options);
+  /* QL series printers take RLE lines in a different form */
+  if (options.pixel_xfer != RLE || options.ql_series)
+    options.adaptive_compression = false;
+  /* The strips are stored side by side, as lines of all strips */
+  if (options.pixel_xfer != BIP)
+    options.bip_strips = 1;
+  else if (options.bip_strips > 1) {
+    if (options.bytes_per_line != BIP_COLUMN_BYTES) {
+      fprintf (stderr, "ERROR: BipStrips requires BytesPerLine=%d\n",
+	       BIP_COLUMN_BYTES);
+      exit (2);
+    }
+    options.bytes_per_line *= options.bip_strips;
+  }
   return options;
 }
 
 void cancel_job (int signal);
+/**
+ * Map standard input into memory if it is a regular file holding
+ * uncompressed raster data in native byte order (version 1 or 3), so
+ * that the raster lines are used where they are instead of being
+ * copied by libcups.  Other input is left to libcups.
+ * @return  true if the input is mapped
+ */
+static bool
+map_raster_input (void) {
+#ifdef HAVE_RASTER_MAP
+  struct stat st;
+  if (fstat (0, &st) != 0 || !S_ISREG (st.st_mode))
+    return false;
+  off_t start = lseek (0, 0, SEEK_CUR);
+  if (start < 0 || st.st_size - start < 4
+      || (uintmax_t) st.st_size > SIZE_MAX)
+    return false;
+  void* map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+  if (map == MAP_FAILED)
+    return false;
+  uint32_t sync;
+  memcpy (&sync, (unsigned char*) map + start, sizeof (sync));
+  if (sync != CUPS_RASTER_SYNC && sync != CUPS_RASTER_SYNCv1) {
+    munmap (map, st.st_size);
+    return false;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise (map, st.st_size, MADV_SEQUENTIAL);
+#endif
+  raster_map = map;
+  raster_map_len = st.st_size;
+  raster_map_pos = start + sizeof (sync);
+  fprintf (stderr, "DEBUG: %s: Raster input mapped\n", progname);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Unmap the raster input, leaving standard input positioned after
+ * the raster data read, as reading it through libcups would.
+ */
+static void
+unmap_raster_input (void) {
+#ifdef HAVE_RASTER_MAP
+  if (!raster_map)
+    return;
+  lseek (0, raster_map_pos, SEEK_SET);
+  munmap ((void*) raster_map, raster_map_len);
+  raster_map = NULL;
+  raster_map_len = raster_map_pos = 0;
+#endif
+}
+
+/**
+ * Take raster data from raster_map.
+ * @param len  Length of the data
+ * @return     Data, or NULL if the input ends first
+ */
+static inline const unsigned char*
+map_read (size_t len) {
+  if (raster_map_len - raster_map_pos < len) {
+    raster_map_pos = raster_map_len;
+    return NULL;
+  }
+  const unsigned char* data = raster_map + raster_map_pos;
+  raster_map_pos += len;
+  return data;
+}
+
+/**
+ * Read a page header from raster_map, rejecting the same headers as
+ * cupsRasterReadHeader2.
+ * @param header  Page header
+ * @return        false if there are no more pages
+ */
+static bool
+map_read_header (cups_page_header2_t* header) {
+  const unsigned char* data = map_read (sizeof (*header));
+  if (!data)
+    return false;
+  memcpy (header, data, sizeof (*header));
+  unsigned bpp = header->cupsColorOrder == CUPS_ORDER_CHUNKED
+    ? (header->cupsBitsPerPixel + 7) / 8
+    : (header->cupsBitsPerColor + 7) / 8;
+  return header->cupsBitsPerPixel <= 240 && header->cupsBitsPerColor <= 16
+    && header->cupsBytesPerLine != 0 && header->cupsHeight != 0
+    && bpp != 0 && header->cupsBytesPerLine % bpp == 0
+    && header->cupsBytesPerLine
+       == ((uint64_t) header->cupsWidth * header->cupsBitsPerPixel + 7) / 8;
+}
+
+/**
+ * Open the raster input stream.  For the Pipeline option, also start
+ * the input reader and output writer threads, so that reading the
+ * input, encoding, and writing the output overlap.  Mapped input
+ * needs no reader, and no raster stream is opened for it.
+ * @param job_options  Job options
+ * @return             Raster input stream, or NULL for mapped input
+ */
+cups_raster_t*
+pipeline_open (job_options_t* job_options) {
+  bool mapped = map_raster_input ();
+  if (job_options->pipeline) {
+#ifdef HAVE_PIPELINE
+    /* Standard input is replaced by the next batch input under a */
+    /* reader, so batch inputs are read without one                */
+    if (!mapped && batch_next >= batch_ninputs)
+      input_ring = ring_new ();
+    output_ring = ring_new ();
+    if ((mapped || input_ring || batch_next < batch_ninputs) && output_ring
+	&& start_thread (&output_ring->thread, output_writer,
+			 output_ring) == 0) {
+      if (mapped)
+	return NULL;
+      if (input_ring
+	  && start_thread (&input_ring->thread, input_reader,
+			   input_ring) == 0) {
+	/* The reader may still wait for input when the job ends */
+	pthread_detach (input_ring->thread);
+	return cupsRasterOpenIO (input_ring_read, input_ring,
+				 CUPS_RASTER_READ);
+      }
+      /* Work without the reader */
+      free (input_ring);
+      input_ring = NULL;
+      return cupsRasterOpen (0, CUPS_RASTER_READ);
+    }
+    fprintf (stderr, "DEBUG: %s: Cannot start pipeline threads\n",
+	     progname);
+    free (input_ring);
+    free (output_ring);
+    input_ring = output_ring = NULL;
+#else
+    fprintf (stderr, "DEBUG: %s: Pipeline not supported\n", progname);
+#endif
+  }
+  return mapped ? NULL : cupsRasterOpen (0, CUPS_RASTER_READ);
+}
+
+/**
+ * Make sure a buffer that is kept for the whole job is at least a
+ * given size.  The buffer only grows.
+ * @param buf       Buffer
+ * @param alloced   Size of buf
+ * @param size      Required size
+ * @return          false if memory is exhausted
+ */
+static bool
+grow_job_buffer (unsigned char** buf, size_t* alloced, size_t size) {
+  if (size <= *alloced && *buf)
+    return true;
+  unsigned char* p = realloc (*buf, size ? size : 1);
+  if (!p)
+    return false;
+  *buf = p;
+  *alloced = size;
+  return true;
+}
+
 /**
  * Prepare for a new page by setting up signalling infrastructure and
- * memory allocation.
+ * memory allocation.  The line buffers are kept from page to page,
+ * and only grow if a page needs larger ones.
  * @param cups_buffer_size    Required size of CUPS raster line buffer
  * @param device_buffer_size  Required size of device pixel line buffer
  */
@@ -633,10 +1576,13 @@ page_prepare (unsigned cups_buffer_size, unsigned device_buffer_size) {
   signal (SIGTERM, cancel_job);
 #endif
 
-  /* Allocate line buffer */
-  buffer = malloc (cups_buffer_size);
-  emit_line_buffer = malloc (device_buffer_size);
-  if (!buffer || !emit_line_buffer) {
+  /* Allocate line buffers; buffer and prev_buffer are swapped */
+  /* from line to line, so they always have the same size       */
+  size_t prev_alloced = buffer_alloced;
+  if (!grow_job_buffer (&buffer, &buffer_alloced, cups_buffer_size)
+      || !grow_job_buffer (&prev_buffer, &prev_alloced, cups_buffer_size)
+      || !grow_job_buffer (&emit_line_buffer, &emit_line_buffer_alloced,
+			   device_buffer_size)) {
     fprintf
       (stderr,
        "ERROR: Cannot allocate memory for raster line buffer\n");
@@ -663,9 +1609,33 @@ page_end () {
 #else
   signal (SIGTERM, SIG_IGN);
 #endif
-  /* Release line buffer memory */
+  /* The line buffers are kept for the next page */
+  page_raster = NULL;
+}
+
+/**
+ * Release the buffers kept for the whole job.
+ */
+void
+free_job_buffers (void) {
   free (buffer);
+  free (prev_buffer);
   free (emit_line_buffer);
+  free (page_raster_buffer);
+  free (rle_buffer);
+  buffer = prev_buffer = emit_line_buffer = NULL;
+  page_raster_buffer = rle_buffer = rle_buffer_next = NULL;
+  buffer_alloced = emit_line_buffer_alloced = 0;
+  page_raster_alloced = rle_alloced = 0;
+  int i;
+  for (i = 0; i < PAGE_CACHE_ENTRIES; i++) {
+    free (page_cache [i].data);
+    page_cache [i].data = NULL;
+  }
+  page_cache_bytes = 0;
+  free (page_record.data);
+  page_record.data = NULL;
+  page_record_alloced = 0;
 }
 
 /**
@@ -674,67 +1644,273 @@ page_end () {
 void
 cancel_job (int signal) {
   /* Emit page end & eject marker */
-  putchar (PTC_EJECT);
+  output_byte (PTC_EJECT);
+  pipeline_close ();
   page_end ();
-  if (rle_buffer) free (rle_buffer);
+  free_job_buffers ();
   exit (0);
 }
 
 /**
- * Emit printer command codes at start of print job.
- * This function does not emit P-touch page specific codes.
+ * Write the printer state to the StateFile.
  * @param job_options   Job options
+ * @param state         State: "clean\n" or "busy\n"
  */
-void
-emit_job_cmds (job_options_t* job_options) {
+static void
+state_file_write (job_options_t* job_options, const char* state) {
+  int fd = open (job_options->state_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  size_t len = strlen (state);
+  if (fd < 0 || write (fd, state, len) != (ssize_t) len)
+    fprintf (stderr, "DEBUG: %s: %s: %s\n", progname,
+	     job_options->state_file, strerror (errno));
+  if (fd >= 0)
+    close (fd);
+}
+
+/**
+ * Determine from the StateFile whether the last job sent to the
+ * printer ended cleanly, and record that the current job has not, so
+ * that an error or a cancelled job makes the next job reset the
+ * printer in full.
+ * @param job_options   Job options
+ * @return              true if the printer is known to be idle
+ */
+static bool
+state_file_start_job (job_options_t* job_options) {
+  if (!job_options->state_file [0])
+    return false;
+  char state [16] = "";
+  int fd = open (job_options->state_file, O_RDONLY);
+  if (fd >= 0) {
+    ssize_t len = read (fd, state, sizeof (state) - 1);
+    state [len > 0 ? len : 0] = '\0';
+    close (fd);
+  }
+  state_file_write (job_options, "busy\n");
+  return strcmp (state, "clean\n") == 0;
+}
+
+/**
+ * Emit the printer reset: NUL bytes to clear the print buffer in case
+ * an error occurred previously, and the initialise command.
+ * @param job_options   Job options
+ */
+static void
+emit_reset (job_options_t* job_options) {
   /* Send 350 bytes of NULL to clear print buffer in case an error occurred
    * previously. The printer ignores 0x00 bytes if it's waiting for a command.
    */
-  int i;
-  for (i=0; i<350; i++) {
-    putchar(0x00);
-  }
+  output_memset (0x00, printer_idle ? job_options->idle_reset : 350);
   /* Initialise printer */
-  putchar (ESC); putchar ('@');
-  /* Emit transfer mode selection command if required */
-  int legacy_xfer_mode = job_options->legacy_xfer_mode;
-  if (legacy_xfer_mode >= 0 && legacy_xfer_mode < 0x100) {
-    putchar (ESC); putchar ('i'); putchar ('R'); putchar (legacy_xfer_mode);
-  }
-  int xfer_mode = job_options->xfer_mode;
-  if (xfer_mode >= 0 && xfer_mode < 0x100) {
-    putchar (ESC); putchar ('i'); putchar ('a'); putchar (xfer_mode);
-  }
-  if (job_options->status_notification != -1) {
-    putchar (ESC); putchar ('i'); putchar ('!'), putchar (job_options->status_notification);
-  }
+  output_cmd (ESC, '@');
+  printer_reset = true;
 }
 
+#ifdef HAVE_CUPSBACKCHANNELREAD
+/** Length of a printer status reply.                    */
+#define STATUS_LENGTH 32
+/** Time to wait for the reply to a status request, in seconds. */
+#define STATUS_TIMEOUT 5.0
+
 /**
- * Emit quality, roll fed media, and label size command codes.
- * @param job_options      Current job options
- * @param header           Current page header
- * @param image_height_px  Number of pixel lines in current page
+ * Printer error flagged in a status reply.
  */
-void
-emit_quality_rollfed_size (job_options_t* job_options,
-                           cups_page_header2_t* header,
-                           unsigned image_height_px) {
-  const unsigned char PI_KIND = 0x02;   // Paper type (roll fed media bit) is valid
-  const unsigned char PI_WIDTH = 0x04;  // Paper width is valid
-  const unsigned char PI_LENGTH = 0x08; // Paper length is valid
-  const unsigned char PI_QUALITY = 0x40;
-  const unsigned char PI_RECOVER = 0x80;
+struct status_error {
+  int byte;               /**< Byte of the status reply: error info 1 or 2 */
+  unsigned char bit;      /**< Error bit                                  */
+  const char* reason;     /**< CUPS printer-state-reason                  */
+  const char* message;    /**< Error message                              */
+};
 
-  unsigned char valid = PI_WIDTH;
-  if (job_options->label_recoyery)
-    valid |= PI_RECOVER;
-  /* Get tape width in mm */
-  unsigned int tape_width_mm = lrint (header->cupsPageSize [0] * MM_PER_PT);
-  if (tape_width_mm > 0xff) {
-    fprintf (stderr,
-             "ERROR: Page width (%umm) exceeds 255mm\n",
-             tape_width_mm);
+/** Printer errors that stop the job.                    */
+static const struct status_error status_errors [] = {
+  { 8, 0x01, "media-empty-error", "No media" },
+  { 8, 0x02, "media-empty-error", "End of media" },
+  { 8, 0x04, "media-jam-error", "Cutter jam" },
+  { 8, 0x08, "other-error", "Weak batteries" },
+  { 8, 0x40, "other-error", "High-voltage adapter" },
+  { 8, 0x80, "other-error", "Fan motor error" },
+  { 9, 0x01, "media-needed-error", "Replace media" },
+  { 9, 0x04, "other-error", "Communication error" },
+  { 9, 0x10, "cover-open-error", "Cover open" },
+  { 9, 0x20, "other-error", "Overheating" },
+  { 9, 0x40, "media-jam-error", "Black marking not detected" },
+  { 9, 0x80, "other-error", "System error" },
+  { }
+};
+
+/** Last status reply from the printer, or part of one.  */
+unsigned char status_reply [STATUS_LENGTH];
+/** Number of bytes read into status_reply.              */
+unsigned status_len = 0;
+/** Whether the printer replied to the status request.   */
+bool status_valid = false;
+
+/**
+ * Read status replies from the printer through the CUPS back channel.
+ * Stops the job if a reply flags an error.
+ * @param timeout  Time to wait for a reply, in seconds
+ */
+static void
+read_printer_status (double timeout) {
+  for (;;) {
+    ssize_t len = cupsBackChannelRead ((char*) status_reply + status_len,
+				       STATUS_LENGTH - status_len, timeout);
+    if (len <= 0)
+      return;
+    status_len += len;
+    if (status_len < STATUS_LENGTH)
+      continue;
+    status_len = 0;
+    if (status_reply [0] != 0x80 || status_reply [1] != STATUS_LENGTH) {
+      fprintf (stderr, "DEBUG: %s: Unknown status reply ignored\n",
+	       progname);
+      continue;
+    }
+    status_valid = true;
+    /* Do not wait for further replies */
+    timeout = 0.0;
+    const struct status_error* error;
+    bool failed = false;
+    for (error = status_errors; error->reason; error++)
+      if (status_reply [error->byte] & error->bit) {
+	fprintf (stderr, "STATE: +%s\n", error->reason);
+	fprintf (stderr, "ERROR: Printer reports: %s\n", error->message);
+	failed = true;
+      }
+    if (failed)
+      exit (1);
+  }
+}
+
+/**
+ * Reset the printer and request its status, before any other printer
+ * data is emitted.
+ * @param job_options   Job options
+ */
+static void
+request_printer_status (job_options_t* job_options) {
+  emit_reset (job_options);
+  output_cmd (ESC, 'i', 'S');
+  output_flush ();
+  read_printer_status (STATUS_TIMEOUT);
+  if (!status_valid)
+    fprintf (stderr, "DEBUG: %s: No status reply from printer\n", progname);
+}
+
+/**
+ * Check the width of the media in the printer against the page width,
+ * before the page is encoded.  Stops the job if they do not match.
+ * @param header        Page header
+ */
+static void
+check_media_width (cups_page_header2_t* header) {
+  unsigned media_mm = status_reply [10];
+  float page_mm = header->cupsPageSize [0] * MM_PER_PT;
+  /* 3.5 mm tape is reported as 4 mm */
+  if (!status_valid || media_mm == 0 || fabsf (media_mm - page_mm) <= 1.0)
+    return;
+  fprintf (stderr, "STATE: +media-needed-error\n");
+  fprintf (stderr, "ERROR: The media in the printer is %u mm wide, "
+	   "but the page is %.1f mm wide\n", media_mm, page_mm);
+  exit (1);
+}
+
+/**
+ * Handle status replies the printer sent while printing.
+ */
+static inline void
+poll_printer_status (void) {
+  if (status_valid)
+    read_printer_status (0.0);
+}
+#else
+static inline void
+poll_printer_status (void) {
+}
+#endif /* HAVE_CUPSBACKCHANNELREAD */
+
+/**
+ * Emit printer command codes at start of print job.
+ * This function does not emit P-touch page specific codes.
+ * @param job_options   Job options
+ */
+void
+emit_job_cmds (job_options_t* job_options) {
+  if (!printer_reset)
+    emit_reset (job_options);
+  /* Emit transfer mode selection command if required */
+  int legacy_xfer_mode = job_options->legacy_xfer_mode;
+  if (legacy_xfer_mode >= 0 && legacy_xfer_mode < 0x100) {
+    output_cmd (ESC, 'i', 'R', legacy_xfer_mode);
+  }
+  int xfer_mode = job_options->xfer_mode;
+  if (xfer_mode >= 0 && xfer_mode < 0x100) {
+    output_cmd (ESC, 'i', 'a', xfer_mode);
+  }
+  if (job_options->status_notification != -1) {
+    output_cmd (ESC, 'i', '!', job_options->status_notification);
+  }
+}
+
+/**
+ * Determine the position of the current page in the job, as
+ * announced in the label preamble.  Counted ConcatPages pages are
+ * announced ahead of their lines, as they were at the end of the last
+ * page.
+ * @param job_options  Job options
+ * @return 0 for the first page, 2 for the last page if LastPageFlag
+ *         is set, and 1 otherwise
+ */
+static unsigned char
+page_position (job_options_t* job_options) {
+  unsigned page = counted_pages ? counted_pages : job_options->page;
+  bool last_page = counted_pages || job_options->last_page;
+  unsigned char which_page = page > 1;
+  if (job_options->last_page_flag && last_page)
+    which_page = 2;
+  return which_page;
+}
+
+/**
+ * Label preamble (ESC i z) of the current page geometry.  It is built
+ * once, as it only depends on the job options and the page size and
+ * resolution; emit_quality_rollfed_size fills in the number of lines
+ * and the page position.
+ */
+typedef struct {
+  bool valid;                 /**< Whether cmd has been built          */
+  float page_size [2];        /**< cupsPageSize cmd was built for      */
+  unsigned resolution [2];    /**< HWResolution cmd was built for      */
+  unsigned char cmd [13];     /**< ESC i z command                     */
+} preamble_template_t;
+
+/** Label preamble of the current page geometry.            */
+preamble_template_t preamble_template;
+
+/**
+ * Build preamble_template for a page header.
+ * @param job_options      Current job options
+ * @param header           Current page header
+ */
+static void
+prepare_preamble_template (job_options_t* job_options,
+                           cups_page_header2_t* header) {
+  const unsigned char PI_KIND = 0x02;   // Paper type (roll fed media bit) is valid
+  const unsigned char PI_WIDTH = 0x04;  // Paper width is valid
+  const unsigned char PI_LENGTH = 0x08; // Paper length is valid
+  const unsigned char PI_QUALITY = 0x40;
+  const unsigned char PI_RECOVER = 0x80;
+
+  unsigned char valid = PI_WIDTH;
+  if (job_options->label_recoyery)
+    valid |= PI_RECOVER;
+  /* Get tape width in mm */
+  unsigned int tape_width_mm = lrint (header->cupsPageSize [0] * MM_PER_PT);
+  if (tape_width_mm > 0xff) {
+    fprintf (stderr,
+             "ERROR: Page width (%umm) exceeds 255mm\n",
+             tape_width_mm);
     tape_width_mm = 0xff;
   }
   unsigned char media_type = 0;
@@ -773,21 +1949,55 @@ emit_quality_rollfed_size (job_options_t* job_options,
       media_type = 0x09;
     }
   }
-  unsigned char which_page = job_options->page > 1;
-  if (job_options->last_page_flag && job_options->last_page)
-    which_page = 2;
-  /* Combine & emit printer command code */
-  putchar (ESC); putchar ('i'); putchar ('z');
-  putchar (valid);
-  putchar (media_type);
-  putchar (tape_width_mm & 0xff);
-  putchar (tape_length_mm);
-  putchar (image_height_px & 0xff);
-  putchar ((image_height_px >> 8) & 0xff);
-  putchar ((image_height_px >> 16) & 0xff);
-  putchar ((image_height_px >> 24) & 0xff);
-  putchar (which_page);
-  putchar (0x00);   // n10, always 0
+  const unsigned char cmd [] = {
+    ESC, 'i', 'z',
+    valid,
+    media_type,
+    tape_width_mm & 0xff,
+    tape_length_mm,
+    0, 0, 0, 0,   // pixel lines, see emit_quality_rollfed_size
+    0,            // page position, likewise
+    0x00          // n10, always 0
+  };
+  memcpy (preamble_template.cmd, cmd, sizeof (cmd));
+  memcpy (preamble_template.page_size, header->cupsPageSize,
+	  sizeof (preamble_template.page_size));
+  memcpy (preamble_template.resolution, header->HWResolution,
+	  sizeof (preamble_template.resolution));
+  preamble_template.valid = true;
+}
+
+/**
+ * Emit quality, roll fed media, and label size command codes.
+ * @param job_options      Current job options
+ * @param header           Current page header
+ * @param image_height_px  Number of pixel lines in current page
+ */
+void
+emit_quality_rollfed_size (job_options_t* job_options,
+                           cups_page_header2_t* header,
+                           unsigned image_height_px) {
+  if (!preamble_template.valid
+      || memcmp (preamble_template.page_size, header->cupsPageSize,
+		 sizeof (preamble_template.page_size)) != 0
+      || memcmp (preamble_template.resolution, header->HWResolution,
+		 sizeof (preamble_template.resolution)) != 0)
+    prepare_preamble_template (job_options, header);
+  unsigned char* cmd = output_reserve (sizeof (preamble_template.cmd));
+  memcpy (cmd, preamble_template.cmd, sizeof (preamble_template.cmd));
+  cmd [7] = image_height_px & 0xff;
+  cmd [8] = (image_height_px >> 8) & 0xff;
+  cmd [9] = (image_height_px >> 16) & 0xff;
+  cmd [10] = (image_height_px >> 24) & 0xff;
+  cmd [11] = page_position (job_options);
+  if (page_recording) {
+    /* Remember where which_page is, to patch it in cached copies */
+    if (page_record.preambles < PAGE_CACHE_MAX_PREAMBLES)
+      page_record.which_page [page_record.preambles++]
+	= page_record.len + output_len - 2;
+    else
+      page_recording = false;
+  }
 }
 
 /**
@@ -806,7 +2016,7 @@ emit_page_cmds (job_options_t* job_options,
   int density = job_options->print_density;
   switch (density) {
   case 1: case 2: case 3: case 4: case 5:
-    putchar (ESC); putchar ('i'); putchar ('D'); putchar (density);
+    output_cmd (ESC, 'i', 'D', density);
     break;
   default: break;
   }
@@ -826,14 +2036,12 @@ emit_page_cmds (job_options_t* job_options,
 	tape_width_mm = 0xff;
       }
       /* Emit printer commands */
-      putchar (ESC); putchar ('i'); putchar ('c');
-      if (header->HWResolution [1] == 360) {
-	putchar (0x84); putchar (0x00); putchar (tape_width_mm & 0xff);
-	putchar (0x00); putchar (0x00);
-      } else {
-	putchar (0x86); putchar (0x09); putchar (tape_width_mm & 0xff);
-	putchar (0x00); putchar (0x01);
-      }
+      if (header->HWResolution [1] == 360)
+	output_cmd (ESC, 'i', 'c',
+		    0x84, 0x00, tape_width_mm & 0xff, 0x00, 0x00);
+      else
+	output_cmd (ESC, 'i', 'c',
+		    0x86, 0x09, tape_width_mm & 0xff, 0x00, 0x01);
     }
   }
 
@@ -842,7 +2050,7 @@ emit_page_cmds (job_options_t* job_options,
     various_mode |= 0x40;
   if (job_options->mirror_print && !job_options->software_mirror)
     various_mode |= 0x80;
-  putchar (ESC); putchar ('i'); putchar ('M'); putchar (various_mode);
+  output_cmd (ESC, 'i', 'M', various_mode);
 
   char advanced_mode = 0;
   if (!job_options->legacy_hires) {
@@ -861,30 +2069,22 @@ emit_page_cmds (job_options_t* job_options,
     advanced_mode |= 0x04;
   if (!job_options->chain_printing)
     advanced_mode |= 0x08;
-  putchar (ESC); putchar ('i'); putchar ('K'); putchar (advanced_mode);
+  output_cmd (ESC, 'i', 'K', advanced_mode);
 
   if (job_options->cut_label != -1) {
-    putchar (ESC); putchar ('i'); putchar('A'); putchar (job_options->cut_label);
+    output_cmd (ESC, 'i', 'A', job_options->cut_label);
   }
 
   float margin = 0.0;
   if (job_options->media != LABELS)
     margin += job_options->min_margin + job_options->margin;
   unsigned feed = lrint (margin * pt2px);
-  putchar (ESC); putchar ('i'); putchar ('d');
-  putchar (feed & 0xff); putchar ((feed >> 8) & 0xff);
-
-  /* Set pixel data transfer compression */
-  if (job_options->pixel_xfer == RLE) {
-    putchar ('M'); putchar (0x02);
-  }
+  output_cmd (ESC, 'i', 'd', feed & 0xff, (feed >> 8) & 0xff);
 
-  /* Emit number of raster lines to follow if using BIP */
-  if (job_options->pixel_xfer == BIP) {
-    unsigned image_height_px = lrint (header->cupsPageSize [1] * pt2px);
-    putchar (ESC); putchar (0x2a); putchar (0x27);
-    putchar (image_height_px & 0xff);
-    putchar ((image_height_px >> 8) & 0xff);
+  /* Set pixel data transfer compression; with AdaptiveCompression, */
+  /* flush_rle_buffer sets it for each band                       */
+  if (job_options->pixel_xfer == RLE && !job_options->adaptive_compression) {
+    output_cmd ('M', 0x02);
   }
 }
 
@@ -948,7 +2148,7 @@ const unsigned char mirror [0x100] = {
  *                            nonzero if line contains nonzero pixels
  */
 static inline int
-generate_emit_line (unsigned char* in_buffer,
+generate_emit_line (const unsigned char* in_buffer,
                     unsigned char* out_buffer,
                     int buflen,
                     unsigned char bytes_per_line,
@@ -1007,10 +2207,537 @@ generate_emit_line (unsigned char* in_buffer,
   return nonzero != 0;
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_LINE_KERNELS 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_LINE_KERNELS 1
+#endif
+
+#if defined(HAVE_X86_LINE_KERNELS) || defined(HAVE_NEON_LINE_KERNELS)
+/*
+ * The vectorised line kernels work in two passes:
+ *
+ * 1. Bring the input bytes into output order: with do_mirror, the
+ *    bytes are copied as they are; otherwise, their order is reversed
+ *    and each byte is bit-mirrored.  The result M is stored in
+ *    line_scratch, surrounded by zero bytes.
+ *
+ * 2. Shift and XOR.  Each of the cases generate_emit_line handles
+ *    boils down to out[k] = (P[k] << a | Q[k] >> (8 - a)) & 0xff,
+ *    where P and Q are M displaced by at most one byte, and 0 <= a < 8.
+ *    The OR of all out[k] before applying the XOR mask is the nonzero
+ *    status generate_emit_line returns.  The result is stored in
+ *    line_result.
+ *
+ * Both buffers are large enough for the passes to read and write whole
+ * vectors past the end of the line.  Each encoder thread has its own.
+ */
+
+/** Zero guard bytes before and after M in line_scratch.  */
+#define LINE_GUARD 64
+/** Line data brought into output order, with zero guards. */
+static THREAD_LOCAL unsigned char
+line_scratch [LINE_GUARD + 0x100 + LINE_GUARD];
+/** Shifted and XORed line data.                          */
+static THREAD_LOCAL unsigned char line_result [0x100 + LINE_GUARD];
+
+/**
+ * Vector kernels for the two passes.
+ */
+typedef struct {
+  /** Store the bytes of in, reversed and bit-mirrored, in m;
+   *  n >= the vector size */
+  void (*reverse_mirror) (unsigned char* m, const unsigned char* in, int n);
+  /** Store (p[k] << a | q[k] >> (8 - a)) & 0xff ^ xormask in out for
+   *  0 <= k < n, and return the OR of the results before the XOR */
+  int (*shift_xor) (unsigned char* out, const unsigned char* p,
+		    const unsigned char* q, int a, int n,
+		    unsigned char xormask);
+  /** Vector size in bytes */
+  int size;
+} line_kernels_t;
+
+/**
+ * Generate a buffer of pixel data ready to emit, using vector kernels.
+ * Arguments and result as for generate_emit_line.
+ */
+static inline int
+generate_emit_line_vector (const line_kernels_t* kernels,
+			   const unsigned char* in_buffer,
+			   unsigned char* out_buffer,
+			   int buflen,
+			   unsigned char bytes_per_line,
+			   int right_padding_bytes,
+			   int shift,
+			   int do_mirror,
+			   unsigned char xormask) {
+  unsigned char* m = line_scratch + LINE_GUARD;
+  const unsigned char *p = m, *q;
+  int a, n;
+
+  if (buflen < kernels->size)
+    return generate_emit_line (in_buffer, out_buffer, buflen, bytes_per_line,
+			       right_padding_bytes, shift, do_mirror, xormask);
+  if (do_mirror)
+    memcpy (m, in_buffer, buflen);
+  else
+    kernels->reverse_mirror (m, in_buffer, buflen);
+  memset (m + buflen, 0, LINE_GUARD);
+
+  if (do_mirror) {
+    /* Shift left; the bits shifted out end up in an extra byte */
+    q = m - 1; a = shift; n = buflen + (shift != 0);
+  } else if (shift > 0) {
+    /* Shift left before mirroring is shift right after mirroring */
+    p = m - 1; q = m; a = 8 - shift; n = buflen + 1;
+  } else {
+    q = m + 1; a = -shift; n = buflen;
+  }
+  int nonzero = kernels->shift_xor (line_result, p, q, a, n, xormask);
+  /* generate_emit_line does not apply the mask to the extra byte */
+  if (do_mirror && shift)
+    line_result [n - 1] ^= xormask;
+
+  memset (out_buffer, xormask, right_padding_bytes);
+  memcpy (out_buffer + right_padding_bytes, line_result, n);
+  memset (out_buffer + right_padding_bytes + n, xormask,
+	  bytes_per_line - right_padding_bytes - n);
+  return nonzero;
+}
+#endif
+
+#ifdef HAVE_X86_LINE_KERNELS
+__attribute__ ((target ("ssse3")))
+static void
+reverse_mirror_ssse3 (unsigned char* m, const unsigned char* in, int n) {
+  const __m128i reverse = _mm_setr_epi8 (15, 14, 13, 12, 11, 10, 9, 8,
+					 7, 6, 5, 4, 3, 2, 1, 0);
+  /* Bit-mirrored nibbles, shifted into the high and low nibble */
+  const __m128i mirror_lo = _mm_setr_epi8 (0x00, 0x80, 0x40, 0xc0,
+					   0x20, 0xa0, 0x60, 0xe0,
+					   0x10, 0x90, 0x50, 0xd0,
+					   0x30, 0xb0, 0x70, 0xf0);
+  const __m128i mirror_hi = _mm_setr_epi8 (0x0, 0x8, 0x4, 0xc,
+					   0x2, 0xa, 0x6, 0xe,
+					   0x1, 0x9, 0x5, 0xd,
+					   0x3, 0xb, 0x7, 0xf);
+  const __m128i nibble = _mm_set1_epi8 (0x0f);
+  int k = 0;
+
+  for (;;) {
+    /* The last vector overlaps the previous one if n % 16 != 0 */
+    if (k + 16 > n)
+      k = n - 16;
+    __m128i v = _mm_loadu_si128 ((const __m128i*) (in + n - 16 - k));
+    v = _mm_shuffle_epi8 (v, reverse);
+    __m128i lo = _mm_and_si128 (v, nibble);
+    __m128i hi = _mm_and_si128 (_mm_srli_epi16 (v, 4), nibble);
+    v = _mm_or_si128 (_mm_shuffle_epi8 (mirror_lo, lo),
+		      _mm_shuffle_epi8 (mirror_hi, hi));
+    _mm_storeu_si128 ((__m128i*) (m + k), v);
+    k += 16;
+    if (k >= n)
+      break;
+  }
+}
+
+__attribute__ ((target ("ssse3")))
+static int
+shift_xor_ssse3 (unsigned char* out, const unsigned char* p,
+		 const unsigned char* q, int a, int n,
+		 unsigned char xormask) {
+  const __m128i left = _mm_cvtsi32_si128 (a);
+  const __m128i right = _mm_cvtsi32_si128 (8 - a);
+  const __m128i left_mask = _mm_set1_epi8 ((0xff << a) & 0xff);
+  const __m128i right_mask = _mm_set1_epi8 (0xff >> (8 - a));
+  const __m128i mask = _mm_set1_epi8 (xormask);
+  __m128i nonzero = _mm_setzero_si128 ();
+  int k;
+
+  for (k = 0; k < n; k += 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i*) (p + k));
+    if (a) {
+      __m128i w = _mm_loadu_si128 ((const __m128i*) (q + k));
+      v = _mm_or_si128
+	(_mm_and_si128 (_mm_sll_epi16 (v, left), left_mask),
+	 _mm_and_si128 (_mm_srl_epi16 (w, right), right_mask));
+    }
+    nonzero = _mm_or_si128 (nonzero, v);
+    _mm_storeu_si128 ((__m128i*) (out + k), _mm_xor_si128 (v, mask));
+  }
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (nonzero, _mm_setzero_si128 ()))
+    != 0xffff;
+}
+
+__attribute__ ((target ("avx2")))
+static void
+reverse_mirror_avx2 (unsigned char* m, const unsigned char* in, int n) {
+  const __m256i reverse = _mm256_setr_epi8 (15, 14, 13, 12, 11, 10, 9, 8,
+					    7, 6, 5, 4, 3, 2, 1, 0,
+					    15, 14, 13, 12, 11, 10, 9, 8,
+					    7, 6, 5, 4, 3, 2, 1, 0);
+  const __m256i mirror_lo = _mm256_setr_epi8 (0x00, 0x80, 0x40, 0xc0,
+					      0x20, 0xa0, 0x60, 0xe0,
+					      0x10, 0x90, 0x50, 0xd0,
+					      0x30, 0xb0, 0x70, 0xf0,
+					      0x00, 0x80, 0x40, 0xc0,
+					      0x20, 0xa0, 0x60, 0xe0,
+					      0x10, 0x90, 0x50, 0xd0,
+					      0x30, 0xb0, 0x70, 0xf0);
+  const __m256i mirror_hi = _mm256_setr_epi8 (0x0, 0x8, 0x4, 0xc,
+					      0x2, 0xa, 0x6, 0xe,
+					      0x1, 0x9, 0x5, 0xd,
+					      0x3, 0xb, 0x7, 0xf,
+					      0x0, 0x8, 0x4, 0xc,
+					      0x2, 0xa, 0x6, 0xe,
+					      0x1, 0x9, 0x5, 0xd,
+					      0x3, 0xb, 0x7, 0xf);
+  const __m256i nibble = _mm256_set1_epi8 (0x0f);
+  int k = 0;
+
+  for (;;) {
+    /* The last vector overlaps the previous one if n % 32 != 0 */
+    if (k + 32 > n)
+      k = n - 32;
+    __m256i v = _mm256_loadu_si256 ((const __m256i*) (in + n - 32 - k));
+    /* Reverse the bytes in each lane, then swap the lanes */
+    v = _mm256_shuffle_epi8 (v, reverse);
+    v = _mm256_permute4x64_epi64 (v, 0x4e);
+    __m256i lo = _mm256_and_si256 (v, nibble);
+    __m256i hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), nibble);
+    v = _mm256_or_si256 (_mm256_shuffle_epi8 (mirror_lo, lo),
+			 _mm256_shuffle_epi8 (mirror_hi, hi));
+    _mm256_storeu_si256 ((__m256i*) (m + k), v);
+    k += 32;
+    if (k >= n)
+      break;
+  }
+}
+
+__attribute__ ((target ("avx2")))
+static int
+shift_xor_avx2 (unsigned char* out, const unsigned char* p,
+		const unsigned char* q, int a, int n,
+		unsigned char xormask) {
+  const __m128i left = _mm_cvtsi32_si128 (a);
+  const __m128i right = _mm_cvtsi32_si128 (8 - a);
+  const __m256i left_mask = _mm256_set1_epi8 ((0xff << a) & 0xff);
+  const __m256i right_mask = _mm256_set1_epi8 (0xff >> (8 - a));
+  const __m256i mask = _mm256_set1_epi8 (xormask);
+  __m256i nonzero = _mm256_setzero_si256 ();
+  int k;
+
+  for (k = 0; k < n; k += 32) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i*) (p + k));
+    if (a) {
+      __m256i w = _mm256_loadu_si256 ((const __m256i*) (q + k));
+      v = _mm256_or_si256
+	(_mm256_and_si256 (_mm256_sll_epi16 (v, left), left_mask),
+	 _mm256_and_si256 (_mm256_srl_epi16 (w, right), right_mask));
+    }
+    nonzero = _mm256_or_si256 (nonzero, v);
+    _mm256_storeu_si256 ((__m256i*) (out + k), _mm256_xor_si256 (v, mask));
+  }
+  return !_mm256_testz_si256 (nonzero, nonzero);
+}
+
+static const line_kernels_t ssse3_kernels = {
+  reverse_mirror_ssse3, shift_xor_ssse3, 16
+};
+static const line_kernels_t avx2_kernels = {
+  reverse_mirror_avx2, shift_xor_avx2, 32
+};
+
+static int
+generate_emit_line_ssse3 (const unsigned char* in_buffer,
+			  unsigned char* out_buffer,
+			  int buflen,
+			  unsigned char bytes_per_line,
+			  int right_padding_bytes,
+			  int shift,
+			  int do_mirror,
+			  unsigned char xormask) {
+  return generate_emit_line_vector (&ssse3_kernels, in_buffer, out_buffer,
+				    buflen, bytes_per_line,
+				    right_padding_bytes, shift, do_mirror,
+				    xormask);
+}
+
+static int
+generate_emit_line_avx2 (const unsigned char* in_buffer,
+			 unsigned char* out_buffer,
+			 int buflen,
+			 unsigned char bytes_per_line,
+			 int right_padding_bytes,
+			 int shift,
+			 int do_mirror,
+			 unsigned char xormask) {
+  return generate_emit_line_vector (&avx2_kernels, in_buffer, out_buffer,
+				    buflen, bytes_per_line,
+				    right_padding_bytes, shift, do_mirror,
+				    xormask);
+}
+#endif /* HAVE_X86_LINE_KERNELS */
+
+#ifdef HAVE_NEON_LINE_KERNELS
+static void
+reverse_mirror_neon (unsigned char* m, const unsigned char* in, int n) {
+  int k = 0;
+
+  for (;;) {
+    /* The last vector overlaps the previous one if n % 16 != 0 */
+    if (k + 16 > n)
+      k = n - 16;
+    uint8x16_t v = vld1q_u8 (in + n - 16 - k);
+    v = vrev64q_u8 (v);
+    v = vextq_u8 (v, v, 8);
+    vst1q_u8 (m + k, vrbitq_u8 (v));
+    k += 16;
+    if (k >= n)
+      break;
+  }
+}
+
+static int
+shift_xor_neon (unsigned char* out, const unsigned char* p,
+		const unsigned char* q, int a, int n,
+		unsigned char xormask) {
+  const int8x16_t left = vdupq_n_s8 (a);
+  const int8x16_t right = vdupq_n_s8 (a - 8);  /* negative: shift right */
+  const uint8x16_t mask = vdupq_n_u8 (xormask);
+  uint8x16_t nonzero = vdupq_n_u8 (0);
+  int k;
+
+  for (k = 0; k < n; k += 16) {
+    uint8x16_t v = vld1q_u8 (p + k);
+    if (a)
+      v = vorrq_u8 (vshlq_u8 (v, left), vshlq_u8 (vld1q_u8 (q + k), right));
+    nonzero = vorrq_u8 (nonzero, v);
+    vst1q_u8 (out + k, veorq_u8 (v, mask));
+  }
+  return vmaxvq_u8 (nonzero) != 0;
+}
+
+static const line_kernels_t neon_kernels = {
+  reverse_mirror_neon, shift_xor_neon, 16
+};
+
+static int
+generate_emit_line_neon (const unsigned char* in_buffer,
+			 unsigned char* out_buffer,
+			 int buflen,
+			 unsigned char bytes_per_line,
+			 int right_padding_bytes,
+			 int shift,
+			 int do_mirror,
+			 unsigned char xormask) {
+  return generate_emit_line_vector (&neon_kernels, in_buffer, out_buffer,
+				    buflen, bytes_per_line,
+				    right_padding_bytes, shift, do_mirror,
+				    xormask);
+}
+#endif /* HAVE_NEON_LINE_KERNELS */
+
+/**
+ * Function type of generate_emit_line and its variants.
+ */
+typedef int (*emit_line_fn) (const unsigned char* in_buffer,
+			     unsigned char* out_buffer,
+			     int buflen,
+			     unsigned char bytes_per_line,
+			     int right_padding_bytes,
+			     int shift,
+			     int do_mirror,
+			     unsigned char xormask);
+
+/** Function generating pixel lines ready to emit: generate_emit_line,
+ *  or a vectorised variant selected by select_line_kernels. */
+emit_line_fn emit_line_kernel = generate_emit_line;
+
+/** @def EMIT_LINE_VARIANT
+ * Define a variant of generate_emit_line for one combination of
+ * do_mirror, the sign of shift, and xormask, so that the branches on
+ * them are resolved at compile time.  The do_mirror and xormask
+ * arguments of the variant are ignored. */
+#define EMIT_LINE_VARIANT(name, MIRROR, SHIFT_SIGN, XORMASK)		\
+  static int								\
+  name (const unsigned char* in_buffer, unsigned char* out_buffer,		\
+	int buflen, unsigned char bytes_per_line,			\
+	int right_padding_bytes, int shift, int do_mirror,		\
+	unsigned char xormask) {					\
+    if ((SHIFT_SIGN > 0 && shift <= 0) || (SHIFT_SIGN < 0 && shift >= 0)) \
+      __builtin_unreachable ();						\
+    return generate_emit_line (in_buffer, out_buffer, buflen,		\
+			       bytes_per_line, right_padding_bytes,	\
+			       SHIFT_SIGN ? shift : 0, MIRROR, XORMASK); \
+  }
+
+EMIT_LINE_VARIANT (emit_line_plain, 0, 0, 0x00)
+EMIT_LINE_VARIANT (emit_line_plain_neg, 0, 0, 0xff)
+EMIT_LINE_VARIANT (emit_line_left, 0, 1, 0x00)
+EMIT_LINE_VARIANT (emit_line_left_neg, 0, 1, 0xff)
+EMIT_LINE_VARIANT (emit_line_right, 0, -1, 0x00)
+EMIT_LINE_VARIANT (emit_line_right_neg, 0, -1, 0xff)
+EMIT_LINE_VARIANT (emit_line_mirror, 1, 0, 0x00)
+EMIT_LINE_VARIANT (emit_line_mirror_neg, 1, 0, 0xff)
+EMIT_LINE_VARIANT (emit_line_mirror_left, 1, 1, 0x00)
+EMIT_LINE_VARIANT (emit_line_mirror_left_neg, 1, 1, 0xff)
+
+/** Lines shorter than this are generated by the scalar variants even
+ *  if emit_line_kernel is vectorised; the vector passes only pay off
+ *  for longer lines. */
+#define VECTOR_MIN_BUFLEN 32
+
+/**
+ * Select the function generating the pixel lines of a page.
+ * Arguments as for generate_emit_line.
+ * @return  Function; the vectorised emit_line_kernel for long lines,
+ *          otherwise the variant of generate_emit_line for do_mirror,
+ *          the sign of shift and xormask
+ */
+static emit_line_fn
+select_emit_line_variant (int buflen, int shift, int do_mirror,
+			  unsigned char xormask) {
+  if (emit_line_kernel != generate_emit_line && buflen >= VECTOR_MIN_BUFLEN)
+    return emit_line_kernel;
+  if (xormask != 0x00 && xormask != 0xff)
+    return generate_emit_line;
+  bool neg = xormask != 0;
+  if (do_mirror) {
+    if (shift == 0)
+      return neg ? emit_line_mirror_neg : emit_line_mirror;
+    if (shift > 0)
+      return neg ? emit_line_mirror_left_neg : emit_line_mirror_left;
+    return generate_emit_line;
+  }
+  if (shift == 0)
+    return neg ? emit_line_plain_neg : emit_line_plain;
+  if (shift > 0)
+    return neg ? emit_line_left_neg : emit_line_left;
+  return neg ? emit_line_right_neg : emit_line_right;
+}
+
+/**
+ * Emit the RLE lines waiting in rle buffer in the form that takes
+ * fewer bytes: as they are, or uncompressed.  Uncompressed, every line
+ * takes 3 + bytes_per_line bytes, as 'Z' is only valid with RLE.  The
+ * compression mode is set before the first band of a page, and before
+ * any band needing another mode than the one before.
+ * @param job_options   Job options
+ */
+static void
+RLE_emit_adaptive (job_options_t* job_options) {
+  unsigned bytes_per_line = job_options->bytes_per_line;
+  unsigned long encoded = rle_buffer_next - rle_buffer;
+  unsigned long raw = (unsigned long) lines_waiting * (3 + bytes_per_line);
+  /* Include the 2 bytes of setting the compression mode */
+  unsigned long rle_cost = encoded + (wire_compression != 0x02 ? 2 : 0);
+  unsigned long raw_cost = raw + (wire_compression != 0x00 ? 2 : 0);
+  int compression = raw_cost < rle_cost ? 0x00 : 0x02;
+  if (compression != wire_compression) {
+    /* Changing the mode costs what an uncompressed band saved */
+    if (wire_compression != -1)
+      stats.saved_bytes -= 2;
+    output_cmd ('M', compression);
+    wire_compression = compression;
+  }
+  if (compression) {
+    output_append (rle_buffer, encoded);
+    return;
+  }
+  /* Already in raw mode, a band may take a byte more raw than encoded */
+  long long delta = (long long) raw - (long long) encoded;
+  stats.encoded_bytes += delta;
+  stats.saved_bytes -= delta;
+  const unsigned char* p = rle_buffer;
+  while (p < rle_buffer_next) {
+    unsigned char* q = output_reserve (3 + bytes_per_line);
+    q [0] = 'G';
+    q [1] =  bytes_per_line       & 0xff;
+    q [2] = (bytes_per_line >> 8) & 0xff;
+    q += 3;
+    if (*p++ == 'Z') {
+      memset (q, 0x00, bytes_per_line);
+      continue;
+    }
+    /* Decode the runs of the line, see RLE_encode_reference */
+    const unsigned char* end = p + 2 + (p [0] | (p [1] << 8));
+    for (p += 2; p < end; ) {
+      signed char n = *p++;
+      if (n >= 0) {
+        memcpy (q, p, n + 1);
+        q += n + 1;
+        p += n + 1;
+      } else {
+        memset (q, *p++, 1 - n);
+        q += 1 - n;
+      }
+    }
+  }
+}
+
+/**
+ * Copy the bit image columns of one strip out of lines of several
+ * strips side by side, turning them into the columns of that strip
+ * one after the other.
+ * @param dst     Buffer for the columns; lines * BIP_COLUMN_BYTES long
+ * @param src     The strip's column in the first line
+ * @param lines   Number of lines
+ * @param stride  Length of a line of all strips
+ */
+static inline void
+BIP_gather_strip (unsigned char* dst, const unsigned char* src,
+                  unsigned lines, unsigned stride) {
+  for (; lines > 0; lines--) {
+    dst [0] = src [0];
+    dst [1] = src [1];
+    dst [2] = src [2];
+    dst += BIP_COLUMN_BYTES;
+    src += stride;
+  }
+}
+
+/**
+ * Emit the lines waiting in rle buffer as BipStrips strips side by
+ * side.  Each strip is a bit image of the strip's columns of all lines,
+ * and the next strip starts 24 dots further across the tape.
+ * @param job_options   Job options
+ */
+static void
+BIP_emit_strips (job_options_t* job_options) {
+  unsigned stride = job_options->bytes_per_line;
+  unsigned s;
+  for (s = 0; s < (unsigned) job_options->bip_strips; s++) {
+    if (s > 0)
+      output_cmd (CR, ESC, 'J', 8 * BIP_COLUMN_BYTES);
+    const unsigned char* p = rle_buffer + s * BIP_COLUMN_BYTES;
+    unsigned lines = lines_waiting;
+    while (lines > 0) {
+      unsigned n = lines < 0xffff ? lines : 0xffff;
+      output_cmd (ESC, 0x2a, 0x27, n & 0xff, (n >> 8) & 0xff);
+      lines -= n;
+      /* Gather as many columns as the output buffer takes at once */
+      while (n > 0) {
+        unsigned m = OUTPUT_BUFFER_SIZE / BIP_COLUMN_BYTES;
+        if (m > n)
+          m = n;
+        BIP_gather_strip (output_reserve (m * BIP_COLUMN_BYTES), p, m,
+                          stride);
+        p += (size_t) m * stride;
+        n -= m;
+      }
+    }
+  }
+}
+
 /**
  * Emit lines waiting in RLE buffer.
  * Resets global variable rle_buffer_next to rle_buffer,
  * and lines_waiting to zero.
+ * If preamble_up_front is set, the label preamble is only emitted
+ * before the first band, and announces all page_lines of the page.
  * @param job_options   Job options
  * @param header        Page header
  */
@@ -1018,61 +2745,49 @@ static inline void
 flush_rle_buffer (job_options_t* job_options,
 		  cups_page_header2_t* header) {
   if (lines_waiting > 0) {
-    if (job_options->label_preamble)
-      emit_quality_rollfed_size (job_options, header, lines_waiting);
+    stage_t prev_stage = stats_enter (STAGE_FLUSH);
+    stats.encoded_bytes += rle_buffer_next - rle_buffer;
+    /* ulp_direct lines are counted as they are reserved */
+    if (!ulp_direct)
+      progress.buffered += lines_waiting;
+    if (job_options->label_preamble) {
+      if (!preamble_up_front)
+        emit_quality_rollfed_size (job_options, header, lines_waiting);
+      else if (!preamble_emitted) {
+        emit_quality_rollfed_size (job_options, header, page_lines);
+        preamble_emitted = true;
+      }
+    }
     xfer_t pixel_xfer = job_options->pixel_xfer;
-    int bytes_per_line = job_options->bytes_per_line;
     switch (pixel_xfer) {
-    case RLE: {
-      fwrite (rle_buffer, sizeof (char), rle_buffer_next - rle_buffer, stdout);
+    case RLE:
+      if (job_options->adaptive_compression) {
+        RLE_emit_adaptive (job_options);
+        break;
+      }
+      /* Fall through */
+    case ULP: {
+      /* ULP lines are stored in rle_buffer uncompressed, ready to emit */
+      if (rle_buffer_next > rle_buffer)
+        output_append (rle_buffer, rle_buffer_next - rle_buffer);
       break;
     }
-    case ULP:
     case BIP: {
+      if (job_options->bip_strips > 1) {
+        BIP_emit_strips (job_options);
+        break;
+      }
+      /* BIP lines are stored in rle_buffer as they are, to follow */
+      /* bit image printing commands of at most 0xffff lines each   */
+      int bytes_per_line = job_options->bytes_per_line;
       unsigned char* p = rle_buffer;
-      unsigned emitted_lines = 0;
-      while (rle_buffer_next - p > 0) {
-        if (pixel_xfer == ULP) {
-	  /* ULP is only used by QL printers */
-          putchar ('g'); putchar (0x00); putchar (bytes_per_line);
-        }
-        int emitted = 0;
-        int linelen;
-        switch (*p++) {
-	case 'G':
-	  linelen = *p++;
-	  linelen += ((int)(*p++)) << 8;
-	  goto expand_g_or_G;
-        case 'g':
-          linelen = ((int)(*p++)) << 8;
-          linelen += *p++;
-	expand_g_or_G:
-          while (linelen > 0) {
-            signed char l = *p++; linelen--;
-            if (l < 0) { /* emit repeated data */
-              char data = *p++; linelen--;
-              emitted -= l; emitted++;
-              for (; l <= 0; l++) putchar (data);
-            } else { /* emit the l + 1 following bytes of data */
-              fwrite (p, sizeof (char), l + 1, stdout);
-              p += l; p++;
-              linelen -= l; linelen--;
-              emitted += l; emitted++;
-            }
-          }
-          if (emitted > bytes_per_line)
-            fprintf (stderr,
-                     "ERROR: Emitted %d > %d bytes for one pixel line!\n",
-                     emitted, bytes_per_line);
-          /* No break; fall through to next case: */
-        case 'Z':
-          for (; emitted < bytes_per_line; emitted++) putchar (0x00);
-          break;
-        default:
-          fprintf (stderr, "ERROR: Unknown RLE flag at %p: '0x%02x'\n",
-                   p - 1, (int)*(p - 1));
-        }
-        emitted_lines++;
+      unsigned lines = lines_waiting;
+      while (lines > 0) {
+        unsigned n = lines < 0xffff ? lines : 0xffff;
+        output_cmd (ESC, 0x2a, 0x27, n & 0xff, (n >> 8) & 0xff);
+        output_append (p, (size_t) n * bytes_per_line);
+        p += (size_t) n * bytes_per_line;
+        lines -= n;
       }
       break;
     }
@@ -1082,9 +2797,61 @@ flush_rle_buffer (job_options_t* job_options,
     }
     rle_buffer_next = rle_buffer;
     lines_waiting = 0;
+    /* Hand each band to the printer as soon as it is complete */
+    if (max_lines_waiting != INT_MAX) {
+      output_flush ();
+      poll_printer_status ();
+    }
+    stats_enter (prev_stage);
   }
 }
 
+/**
+ * Grow rle buffer to a given size, limited by the BufferSize option.
+ * Global variables rle_buffer and rle_buffer_next might be altered.
+ * @param job_options   Job options
+ * @param size          Size to grow to
+ * @return              false if rle buffer cannot grow that large
+ */
+static bool
+grow_rle_buffer (job_options_t* job_options, unsigned long size) {
+  if (size > (unsigned long) job_options->buffer_size)
+    return false;
+  unsigned long nextpos = rle_buffer_next - rle_buffer;
+  void* p = realloc (rle_buffer, size * sizeof (char));
+  if (!p)
+    return false;
+  rle_buffer = p;
+  rle_buffer_next = rle_buffer + nextpos;
+  rle_alloced = size;
+  stats.rle_reallocs++;
+  return true;
+}
+
+/**
+ * Size rle buffer for the lines of a page that are held back, so that
+ * it does not need to grow line by line.  rle buffer is kept from page
+ * to page and never shrinks.
+ * @param job_options   Job options
+ * @param header        Page header
+ */
+static void
+reserve_rle_buffer (job_options_t* job_options,
+                    cups_page_header2_t* header) {
+  if (ulp_direct)
+    return;  /* No lines are stored in rle buffer */
+  unsigned long lines = header->cupsHeight;
+  if (lines > max_lines_waiting)
+    lines = max_lines_waiting;
+  /* Worst case size of a stored line, see RLE_store_line */
+  unsigned bytes_per_line = job_options->bytes_per_line;
+  unsigned long size = lines * (4 + bytes_per_line + bytes_per_line / 128);
+  if (size > (unsigned long) job_options->buffer_size)
+    size = job_options->buffer_size;
+  if (size > rle_alloced)
+    grow_rle_buffer (job_options, size);
+}
+
 /**
  * Ensure sufficient memory available in rle buffer.
  * If rle buffer needs to be extended, global variables rle_buffer and
@@ -1101,14 +2868,18 @@ ensure_rle_buf_space (job_options_t* job_options,
   if (nextpos + bytes > rle_alloced) {
     /* Exponential size increase avoids too frequent reallocation */
     unsigned long new_alloced = rle_alloced * 2 + 0x4000;
-    void* p = NULL;
-    if (new_alloced <= 1000000)
-      p = realloc (rle_buffer, new_alloced * sizeof (char));
-    if (p) {
-      rle_buffer = p;
-      rle_buffer_next = rle_buffer + nextpos;
-      rle_alloced = new_alloced;
-    } else { /* Gain memory by flushing buffer to printer */
+    if (new_alloced > (unsigned long) job_options->buffer_size)
+      new_alloced = job_options->buffer_size;
+    if (new_alloced < nextpos + bytes)
+      new_alloced = nextpos + bytes;
+    if (!grow_rle_buffer (job_options, new_alloced)) {
+      /* Strips only follow each other at the end of the page */
+      if (job_options->bip_strips > 1) {
+        fprintf (stderr, "ERROR: Page does not fit in BufferSize "
+                 "with BipStrips\n");
+        exit (1);
+      }
+      /* Gain memory by flushing buffer to printer */
       flush_rle_buffer (job_options, header);
       if (rle_buffer_next - rle_buffer + bytes > rle_alloced) {
         fprintf (stderr,
@@ -1127,16 +2898,15 @@ ensure_rle_buf_space (job_options_t* job_options,
 /** @def APPEND_REPEATED_BYTE
  * Macro for appending repeated-byte run to rle_buffer */
 /**
- * Store buffer data in rle buffer using run-length encoding.
- * @param job_options   Job options
- * @param header        Page header
+ * Run-length encode buffer data.  This is the reference implementation
+ * of the encoding; the vectorised encoders produce identical output.
+ * @param rle_next      Where to store the RLE data.
+ *                      Must have room for at least buf_len + buf_len/128 + 1
+ *                      bytes.
  * @param buf           Buffer containing data to store
  * @param buf_len       Length of buffer
- *
- * Global variable rle_buffer_next is a pointer into buffer for holding RLE data.
- * Must have room for at least 3 + buf_len + buf_len/128 + 1
- * bytes (ensured by reallocation).
- * On return, rle_buffer_next points to first unused buffer byte.
+ * @param nonzero_ret   Returns the OR of all buffer bytes
+ * @return              Pointer to the first byte after the RLE data
  *
  * This implementation enjoys the property that
  * the resulting RLE is at most buf_len + buf_len/128 + 1 bytes
@@ -1152,15 +2922,10 @@ ensure_rle_buf_space (job_options_t* job_options,
  * can cause the RLE representation to be longer (by 1 byte) than the
  * corresponding input sequence in buf.
  */
-static inline void
-RLE_store_line (job_options_t* job_options,
-		cups_page_header2_t* header,
-                const unsigned char* buf, unsigned buf_len) {
-  ensure_rle_buf_space (job_options, header,
-                        4 + buf_len + buf_len / 128);
-  unsigned char* rle_next = rle_buffer_next + 3;
-  /* Make room for 3 initial meta data bytes, */
-  /* written when actual length is known      */
+static unsigned char*
+RLE_encode_reference (unsigned char* rle_next,
+                      const unsigned char* buf, unsigned buf_len,
+                      unsigned char* nonzero_ret) {
   const unsigned char* buf_end = buf + buf_len; /* Buffer end */
   const unsigned char* mix_start;  /* Start of mixed bytes run */
 
@@ -1243,30 +3008,428 @@ RLE_store_line (job_options_t* job_options,
   if (mix_len > 0) { /* Case where final mixed run is 129 bytes */
     APPEND_MIXED_BYTES;
   }
-  unsigned rle_len = rle_next - rle_buffer_next - 3;
-  /* Store rle line meta data (length and (non)zero status) */
-  if (nonzero) { /* Check for nonempty (no black pixels) line */
-    if (job_options->ql_series) {
-      rle_buffer_next [0] = 'g';
-      rle_buffer_next [1] = (rle_len >> 8) & 0xff;
-      rle_buffer_next [2] =  rle_len       & 0xff;
-    } else {
-      rle_buffer_next [0] = 'G';
-      rle_buffer_next [1] =  rle_len       & 0xff;
-      rle_buffer_next [2] = (rle_len >> 8) & 0xff;
-    }
-    rle_buffer_next = rle_next;
-  } else {
-    rle_buffer_next [0] = 'Z';
-    rle_buffer_next++;
-  }
-  lines_waiting++;
-  if (lines_waiting >= max_lines_waiting)
-    flush_rle_buffer (job_options, header);
+  *nonzero_ret = nonzero;
+  return rle_next;
 }
 
-/**
- * Store a number of empty lines in rle_buffer using RLE.
+/*
+ * The vectorised encoders produce the same runs as RLE_encode_reference,
+ * based on the following observations:
+ * - Each maximal run of 3 or more repeated bytes is stored as repeated-
+ *   byte runs of 129 bytes, followed by a shorter repeated-byte run if
+ *   at least 3 bytes remain.  Any 1 or 2 remaining bytes start the next
+ *   mixed-bytes run.
+ * - All other bytes are stored as mixed-bytes runs of 128 bytes,
+ *   followed by a shorter mixed-bytes run for any remaining bytes.
+ * Finding the start and end of runs of repeated bytes is what the
+ * vector comparisons are used for.
+ */
+
+/**
+ * Run-length encode buffer data.
+ * Arguments and result as for RLE_encode_reference.
+ * @param line_nonzero  Return whether a buffer contains nonzero bytes
+ * @param find_repeat   Return the start of the first run of 3 repeated
+ *                      bytes in a buffer, or the buffer end
+ * @param find_run_end  Return the first byte after a buffer's first byte
+ *                      that differs from it, or the buffer end
+ */
+static inline __attribute__ ((always_inline)) unsigned char*
+RLE_encode_runs (unsigned char* rle_next,
+                 const unsigned char* buf, unsigned buf_len,
+                 unsigned char* nonzero_ret,
+                 bool (*line_nonzero) (const unsigned char*,
+                                       const unsigned char*),
+                 const unsigned char* (*find_repeat) (const unsigned char*,
+                                                      const unsigned char*),
+                 const unsigned char* (*find_run_end) (const unsigned char*,
+                                                       const unsigned char*)) {
+  const unsigned char* buf_end = buf + buf_len;
+  const unsigned char* mix_start = buf;
+  const unsigned char* next = buf;
+
+  *nonzero_ret = line_nonzero (buf, buf_end);
+  if (!*nonzero_ret)
+    return rle_next;  /* The line is stored as 'Z' */
+  for (;;) {
+    const unsigned char* rep_start = find_repeat (next, buf_end);
+    while (rep_start > mix_start) {
+      unsigned mix_len = rep_start - mix_start;
+      APPEND_MIXED_BYTES;
+      mix_start += mix_len;
+    }
+    if (rep_start == buf_end)
+      break;
+    unsigned char rep_val = *rep_start;
+    next = find_run_end (rep_start, buf_end);
+    unsigned left = next - rep_start;
+    for (; left >= 129; left -= 129) {
+      *rle_next++ = (signed char)(1 - 129);
+      *rle_next++ = rep_val;
+    }
+    if (left > 2) {
+      *rle_next++ = (signed char)(1 - left);
+      *rle_next++ = rep_val;
+      left = 0;
+    }
+    mix_start = next - left;
+  }
+  return rle_next;
+}
+
+/**
+ * Scalar tail of find_repeat.
+ */
+static inline __attribute__ ((always_inline)) const unsigned char*
+find_repeat_scalar (const unsigned char* p, const unsigned char* end) {
+  for (; end - p >= 3; p++)
+    if (p [0] == p [1] && p [1] == p [2])
+      return p;
+  return end;
+}
+
+/**
+ * Scalar tail of find_run_end: return the first byte from p on that
+ * differs from val, or end.
+ */
+static inline __attribute__ ((always_inline)) const unsigned char*
+find_run_end_scalar (const unsigned char* p, const unsigned char* end,
+                     unsigned char val) {
+  for (; p != end && *p == val; p++)
+    ;
+  return p;
+}
+
+/**
+ * Scalar line_nonzero for RLE_encode_runs.
+ */
+static inline __attribute__ ((always_inline)) bool
+line_nonzero_scalar (const unsigned char* p, const unsigned char* end) {
+  unsigned char acc = 0;
+  for (; p != end; p++)
+    acc |= *p;
+  return acc != 0;
+}
+
+/**
+ * Scalar find_run_end for RLE_encode_runs.
+ */
+static inline __attribute__ ((always_inline)) const unsigned char*
+find_run_end_first_scalar (const unsigned char* p, const unsigned char* end) {
+  return find_run_end_scalar (p + 1, end, *p);
+}
+
+#ifdef HAVE_X86_LINE_KERNELS
+__attribute__ ((target ("sse2")))
+static inline __attribute__ ((always_inline)) bool
+line_nonzero_sse2 (const unsigned char* p, const unsigned char* end) {
+  __m128i acc = _mm_setzero_si128 ();
+  for (; end - p >= 16; p += 16)
+    acc = _mm_or_si128 (acc, _mm_loadu_si128 ((const __m128i*) p));
+  unsigned char tail = 0;
+  for (; p != end; p++)
+    tail |= *p;
+  return tail
+    || _mm_movemask_epi8 (_mm_cmpeq_epi8 (acc, _mm_setzero_si128 ()))
+       != 0xffff;
+}
+
+__attribute__ ((target ("sse2")))
+static inline __attribute__ ((always_inline)) const unsigned char*
+find_repeat_sse2 (const unsigned char* p, const unsigned char* end) {
+  for (; end - p >= 18; p += 16) {
+    __m128i a = _mm_loadu_si128 ((const __m128i*) p);
+    __m128i b = _mm_loadu_si128 ((const __m128i*) (p + 1));
+    __m128i c = _mm_loadu_si128 ((const __m128i*) (p + 2));
+    unsigned m = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (a, b),
+						   _mm_cmpeq_epi8 (b, c)));
+    if (m)
+      return p + __builtin_ctz (m);
+  }
+  return find_repeat_scalar (p, end);
+}
+
+__attribute__ ((target ("sse2")))
+static inline __attribute__ ((always_inline)) const unsigned char*
+find_run_end_sse2 (const unsigned char* p, const unsigned char* end) {
+  unsigned char val = *p++;
+  __m128i v = _mm_set1_epi8 (val);
+  for (; end - p >= 16; p += 16) {
+    unsigned m = _mm_movemask_epi8
+      (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*) p), v)) ^ 0xffff;
+    if (m)
+      return p + __builtin_ctz (m);
+  }
+  return find_run_end_scalar (p, end, val);
+}
+
+__attribute__ ((target ("sse2")))
+static unsigned char*
+RLE_encode_sse2 (unsigned char* rle_next,
+                 const unsigned char* buf, unsigned buf_len,
+                 unsigned char* nonzero_ret) {
+  return RLE_encode_runs (rle_next, buf, buf_len, nonzero_ret,
+			  line_nonzero_sse2, find_repeat_sse2,
+			  find_run_end_sse2);
+}
+
+#endif /* HAVE_X86_LINE_KERNELS */
+
+#ifdef HAVE_NEON_LINE_KERNELS
+/**
+ * Turn the result of a NEON byte comparison into a bit mask with 4 bits
+ * per byte.
+ */
+static inline uint64_t
+neon_compare_mask (uint8x16_t cmp) {
+  return vget_lane_u64
+    (vreinterpret_u64_u8 (vshrn_n_u16 (vreinterpretq_u16_u8 (cmp), 4)), 0);
+}
+
+static inline __attribute__ ((always_inline)) bool
+line_nonzero_neon (const unsigned char* p, const unsigned char* end) {
+  uint8x16_t acc = vdupq_n_u8 (0);
+  for (; end - p >= 16; p += 16)
+    acc = vorrq_u8 (acc, vld1q_u8 (p));
+  unsigned char tail = 0;
+  for (; p != end; p++)
+    tail |= *p;
+  return tail || vmaxvq_u8 (acc) != 0;
+}
+
+static inline __attribute__ ((always_inline)) const unsigned char*
+find_repeat_neon (const unsigned char* p, const unsigned char* end) {
+  for (; end - p >= 18; p += 16) {
+    uint8x16_t a = vld1q_u8 (p);
+    uint8x16_t b = vld1q_u8 (p + 1);
+    uint8x16_t c = vld1q_u8 (p + 2);
+    uint64_t m = neon_compare_mask (vandq_u8 (vceqq_u8 (a, b),
+					      vceqq_u8 (b, c)));
+    if (m)
+      return p + __builtin_ctzll (m) / 4;
+  }
+  return find_repeat_scalar (p, end);
+}
+
+static inline __attribute__ ((always_inline)) const unsigned char*
+find_run_end_neon (const unsigned char* p, const unsigned char* end) {
+  unsigned char val = *p++;
+  uint8x16_t v = vdupq_n_u8 (val);
+  for (; end - p >= 16; p += 16) {
+    uint64_t m = ~neon_compare_mask (vceqq_u8 (vld1q_u8 (p), v));
+    if (m)
+      return p + __builtin_ctzll (m) / 4;
+  }
+  return find_run_end_scalar (p, end, val);
+}
+
+static unsigned char*
+RLE_encode_neon (unsigned char* rle_next,
+                 const unsigned char* buf, unsigned buf_len,
+                 unsigned char* nonzero_ret) {
+  return RLE_encode_runs (rle_next, buf, buf_len, nonzero_ret,
+			  line_nonzero_neon, find_repeat_neon,
+			  find_run_end_neon);
+}
+#endif /* HAVE_NEON_LINE_KERNELS */
+
+/** Function run-length encoding lines: RLE_encode_reference, or a
+ *  vectorised variant selected by select_line_kernels. */
+unsigned char* (*rle_encoder) (unsigned char* rle_next,
+			       const unsigned char* buf, unsigned buf_len,
+			       unsigned char* nonzero_ret)
+  = RLE_encode_reference;
+
+/**
+ * Select the fastest variants of generate_emit_line and
+ * RLE_encode_reference the CPU supports.
+ */
+void
+select_line_kernels (void) {
+#ifdef HAVE_X86_LINE_KERNELS
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    emit_line_kernel = generate_emit_line_avx2;
+  else if (__builtin_cpu_supports ("ssse3"))
+    emit_line_kernel = generate_emit_line_ssse3;
+  /* At the line lengths of the supported printers, an AVX2 encoder
+     is no faster than this one */
+  if (__builtin_cpu_supports ("sse2"))
+    rle_encoder = RLE_encode_sse2;
+#endif
+#ifdef HAVE_NEON_LINE_KERNELS
+  emit_line_kernel = generate_emit_line_neon;
+  rle_encoder = RLE_encode_neon;
+#endif
+}
+
+/**
+ * Complete a line run-length encoded at line + 3 by storing its meta
+ * data (length and (non)zero status), as a 'Z' line if it is empty.
+ * @param line          Start of the line
+ * @param rle_next      End of the RLE data
+ * @param nonzero       Whether the line contains nonzero bytes
+ * @param ql_series     Whether to store the line for a QL printer
+ * @return              End of the line
+ */
+static inline __attribute__ ((always_inline)) unsigned char*
+RLE_complete_line (unsigned char* line, unsigned char* rle_next,
+                   unsigned char nonzero, bool ql_series) {
+  unsigned rle_len = rle_next - line - 3;
+  if (!nonzero) {  /* Empty (no black pixels) line */
+    line [0] = 'Z';
+    return line + 1;
+  }
+  if (ql_series) {
+    line [0] = 'g';
+    line [1] = (rle_len >> 8) & 0xff;
+    line [2] =  rle_len       & 0xff;
+  } else {
+    line [0] = 'G';
+    line [1] =  rle_len       & 0xff;
+    line [2] = (rle_len >> 8) & 0xff;
+  }
+  return rle_next;
+}
+
+/**
+ * Complete a line run-length encoded at rle_buffer_next + 3, see
+ * RLE_complete_line.
+ * @param job_options   Job options
+ * @param header        Page header
+ * @param rle_next      End of the RLE data
+ * @param nonzero       Whether the line contains nonzero bytes
+ * @param ql_series     Whether to store the line for a QL printer
+ *
+ * On return, rle_buffer_next points to first unused buffer byte.
+ */
+static inline __attribute__ ((always_inline)) void
+RLE_store_encoded_line (job_options_t* job_options,
+                        cups_page_header2_t* header,
+                        unsigned char* rle_next, unsigned char nonzero,
+                        bool ql_series) {
+  unsigned char* line_start = rle_buffer_next;
+  rle_buffer_next = RLE_complete_line (line_start, rle_next, nonzero,
+                                       ql_series);
+  /* Keep a copy for RLE_store_repeated_line */
+  rle_last_line_len = rle_buffer_next - line_start;
+  memcpy (rle_last_line, line_start, rle_last_line_len);
+  lines_waiting++;
+  if (lines_waiting >= max_lines_waiting)
+    flush_rle_buffer (job_options, header);
+}
+
+/**
+ * Store buffer data in rle buffer using run-length encoding.
+ * @param job_options   Job options
+ * @param header        Page header
+ * @param buf           Buffer containing data to store
+ * @param buf_len       Length of buffer
+ *
+ * Global variable rle_buffer_next is a pointer into buffer for holding RLE data.
+ * Must have room for at least 3 + buf_len + buf_len/128 + 1
+ * bytes (ensured by reallocation).
+ * On return, rle_buffer_next points to first unused buffer byte.
+ */
+static inline void
+RLE_store_line (job_options_t* job_options,
+		cups_page_header2_t* header,
+                const unsigned char* buf, unsigned buf_len) {
+  ensure_rle_buf_space (job_options, header,
+                        4 + buf_len + buf_len / 128);
+  /* Make room for 3 initial meta data bytes, */
+  /* written when actual length is known      */
+  unsigned char nonzero;
+  unsigned char* rle_next =
+    rle_encoder (rle_buffer_next + 3, buf, buf_len, &nonzero);
+  RLE_store_encoded_line (job_options, header, rle_next, nonzero,
+                          job_options->ql_series);
+}
+
+/**
+ * Store the line last stored by RLE_store_line in rle_buffer again.
+ * @param job_options   Job options
+ * @param header        Page header
+ */
+static inline void
+RLE_store_repeated_line (job_options_t* job_options,
+                         cups_page_header2_t* header) {
+  ensure_rle_buf_space (job_options, header, rle_last_line_len);
+  memcpy (rle_buffer_next, rle_last_line, rle_last_line_len);
+  rle_buffer_next += rle_last_line_len;
+  lines_waiting++;
+  if (lines_waiting >= max_lines_waiting)
+    flush_rle_buffer (job_options, header);
+}
+
+/**
+ * Store a line run-length encoded elsewhere, as RLE_complete_line
+ * completed it, in rle_buffer as RLE_store_line would.
+ * @param job_options   Job options
+ * @param header        Page header
+ * @param line          Encoded line
+ * @param len           Length of line
+ */
+static inline void
+RLE_store_encoded_copy (job_options_t* job_options,
+                        cups_page_header2_t* header,
+                        const unsigned char* line, unsigned len) {
+  unsigned bytes_per_line = job_options->bytes_per_line;
+  stats.pixel_lines++;
+  stats.pixel_bytes += bytes_per_line;
+  /* Reserve as much as RLE_store_line, which flushes at the same lines */
+  ensure_rle_buf_space (job_options, header,
+                        4 + bytes_per_line + bytes_per_line / 128);
+  memcpy (rle_buffer_next, line, len);
+  rle_buffer_next += len;
+  rle_last_line_len = len;
+  memcpy (rle_last_line, line, len);
+  lines_waiting++;
+  if (lines_waiting >= max_lines_waiting)
+    flush_rle_buffer (job_options, header);
+}
+
+/**
+ * Generate rle_empty_line for a given XOR mask: an empty line is 'Z',
+ * a filled line (negative printing) is encoded as repeated bytes.
+ * @param job_options     Job options
+ * @param xormask         The XOR mask for negative printing
+ */
+static void
+RLE_prepare_empty_line (job_options_t* job_options,
+                        unsigned char xormask) {
+  unsigned char* line = rle_empty_line;
+  if (!xormask) {
+    line [0] = 'Z';
+    rle_empty_len = 1;
+  } else {
+    unsigned char* next = line + 3;
+    int len, rep_len;
+    for (len = job_options->bytes_per_line; len > 0; len -= rep_len) {
+      rep_len = len;
+      if (rep_len > 129) rep_len = 129;
+      *(next++) = (signed char) (1 - rep_len);
+      *(next++) = xormask;
+    }
+    unsigned int rle_len = next - line - 3;
+    if (job_options->ql_series) {
+      line [0] = 'g';
+      line [1] = (rle_len >> 8) & 0xff;
+      line [2] = rle_len & 0xff;
+    } else {
+      line [0] = 'G';
+      line [1] = rle_len & 0xff;
+      line [2] = (rle_len >> 8) & 0xff;
+    }
+    rle_empty_len = next - line;
+  }
+  rle_empty_xormask = xormask;
+}
+
+/**
+ * Store a number of empty lines in rle_buffer using RLE.  The lines
+ * are copies of rle_empty_line, stored as many at a time as the band
+ * and the BufferSize option allow.
  * @param job_options     Job options
  * @param header          Page header
  * @param empty_lines     Number of empty lines to store
@@ -1277,52 +3440,567 @@ RLE_store_empty_lines (job_options_t* job_options,
                        cups_page_header2_t* header,
                        int empty_lines,
                        unsigned char xormask) {
-  int bytes_per_line = job_options->bytes_per_line;
-  lines_waiting += empty_lines;
-  if (xormask) {
-    int blocks = (bytes_per_line + 127) / 128;
-    ensure_rle_buf_space (job_options, header,
-                          empty_lines * blocks);
-
-    for (; empty_lines--; ) {
-      /* leave space for the command prefix */
-      rle_buffer_next += 3;
-      unsigned char *start = rle_buffer_next;
-      int len, rep_len;
-      for (len = bytes_per_line; len > 0; len -= rep_len) {
-        rep_len = len;
-        if (rep_len > 129) rep_len = 129;
-        *(rle_buffer_next++) = (signed char) (1 - rep_len);
-        *(rle_buffer_next++) = xormask;
-      }
-      unsigned int rle_len = rle_buffer_next - start;
-      if (job_options->ql_series) {
-	start [-3] = 'g';
-	start [-2] = (rle_len >> 8) & 0xff;
-	start [-1] = rle_len & 0xff;
-      } else {
-	start [-3] = 'G';
-	start [-2] = rle_len & 0xff;
-	start [-1] = (rle_len >> 8) & 0xff;
+  if (rle_empty_xormask != xormask)
+    RLE_prepare_empty_line (job_options, xormask);
+  unsigned line_len = rle_empty_len;
+  unsigned long buffer_size = job_options->buffer_size;
+  while (empty_lines > 0) {
+    unsigned n = empty_lines;
+    if (n > max_lines_waiting - lines_waiting)
+      n = max_lines_waiting - lines_waiting;
+    unsigned long used = rle_buffer_next - rle_buffer;
+    unsigned long room = used < buffer_size
+      ? (buffer_size - used) / line_len : 0;
+    if (room == 0 && lines_waiting > 0) {
+      flush_rle_buffer (job_options, header);
+      continue;
+    }
+    /* ensure_rle_buf_space reports a buffer too small for one line */
+    if (room == 0)
+      room = 1;
+    if (n > room)
+      n = room;
+    unsigned long bytes = (unsigned long) n * line_len;
+    ensure_rle_buf_space (job_options, header, bytes);
+    if (line_len == 1)
+      memset (rle_buffer_next, rle_empty_line [0], n);
+    else {
+      /* Double the copies made so far until there are n of them */
+      unsigned long done = line_len;
+      memcpy (rle_buffer_next, rle_empty_line, line_len);
+      while (done < bytes) {
+        unsigned long chunk = done < bytes - done ? done : bytes - done;
+        memcpy (rle_buffer_next + done, rle_buffer_next, chunk);
+        done += chunk;
       }
     }
-  } else {
-    ensure_rle_buf_space (job_options, header, empty_lines);
-    for (; empty_lines--; ) *(rle_buffer_next++) = 'Z';
+    rle_buffer_next += bytes;
+    lines_waiting += n;
+    empty_lines -= n;
+    if (lines_waiting >= max_lines_waiting)
+      flush_rle_buffer (job_options, header);
   }
 }
 
 /**
- * Emit raster lines for current page.
+ * Reserve space for uncompressed (ULP or BIP) lines.
+ * ULP lines are emitted right away if ulp_direct is set, preceded by
+ * the label preamble if that has not been emitted yet.  Otherwise,
+ * they are stored in rle_buffer in the form they are emitted in.
  * @param job_options   Job options
- * @param ras           Raster data stream
  * @param header        Page header
- * @return              0 on success, nonzero otherwise
+ * @param bytes         Number of bytes required; at most one line
+ * @return              Pointer to the reserved bytes
  */
-int
-emit_raster_lines (job_options_t* job_options,
-                   cups_raster_t* ras,
+static inline unsigned char*
+ULP_reserve (job_options_t* job_options,
+             cups_page_header2_t* header,
+             unsigned bytes) {
+  if (ulp_direct) {
+    if (preamble_up_front && !preamble_emitted) {
+      emit_quality_rollfed_size (job_options, header, page_lines);
+      preamble_emitted = true;
+    }
+    stats.encoded_bytes += bytes;
+    unsigned char* p = output_reserve (bytes);
+    progress.buffered++;  /* Called once per line */
+    return p;
+  }
+  ensure_rle_buf_space (job_options, header, bytes);
+  unsigned char* p = rle_buffer_next;
+  rle_buffer_next += bytes;
+  return p;
+}
+
+/**
+ * Store a line of pixel data uncompressed (ULP).
+ * @param job_options   Job options
+ * @param header        Page header
+ * @param buf           Buffer containing the line; bytes_per_line long
+ */
+static inline void
+ULP_store_line (job_options_t* job_options,
+                cups_page_header2_t* header,
+                const unsigned char* buf) {
+  int bytes_per_line = job_options->bytes_per_line;
+  unsigned char* p = ULP_reserve (job_options, header, 3 + bytes_per_line);
+  p [0] = 'g';
+  p [1] = 0x00;
+  p [2] = bytes_per_line;
+  memcpy (p + 3, buf, bytes_per_line);
+  lines_waiting++;
+  if (lines_waiting >= max_lines_waiting)
+    flush_rle_buffer (job_options, header);
+}
+
+/**
+ * Store a number of empty lines uncompressed (ULP).
+ * @param job_options     Job options
+ * @param header          Page header
+ * @param empty_lines     Number of empty lines to store
+ * @param xormask         The XOR mask for negative printing
+ */
+static inline void
+ULP_store_empty_lines (job_options_t* job_options,
+                       cups_page_header2_t* header,
+                       int empty_lines,
+                       unsigned char xormask) {
+  int bytes_per_line = job_options->bytes_per_line;
+  if (ulp_empty_xormask != xormask) {
+    ulp_empty_line [0] = 'g';
+    ulp_empty_line [1] = 0x00;
+    ulp_empty_line [2] = bytes_per_line;
+    memset (ulp_empty_line + 3, xormask, bytes_per_line);
+    ulp_empty_xormask = xormask;
+  }
+  for (; empty_lines > 0; empty_lines--) {
+    unsigned char* p = ULP_reserve (job_options, header, 3 + bytes_per_line);
+    memcpy (p, ulp_empty_line, 3 + bytes_per_line);
+    lines_waiting++;
+    if (lines_waiting >= max_lines_waiting)
+      flush_rle_buffer (job_options, header);
+  }
+}
+
+/**
+ * Store a line of pixel data for bit image printing (BIP).  The line
+ * is stored as it is; flush_rle_buffer emits the bit image printing
+ * command for the number of lines stored.
+ * @param job_options   Job options
+ * @param header        Page header
+ * @param buf           Buffer containing the line; bytes_per_line long
+ */
+static inline void
+BIP_store_line (job_options_t* job_options,
+                cups_page_header2_t* header,
+                const unsigned char* buf) {
+  int bytes_per_line = job_options->bytes_per_line;
+  memcpy (ULP_reserve (job_options, header, bytes_per_line), buf,
+          bytes_per_line);
+  lines_waiting++;
+  if (lines_waiting >= max_lines_waiting)
+    flush_rle_buffer (job_options, header);
+}
+
+/**
+ * Store a number of empty lines for bit image printing (BIP).
+ * @param job_options     Job options
+ * @param header          Page header
+ * @param empty_lines     Number of empty lines to store
+ * @param xormask         The XOR mask for negative printing
+ */
+static inline void
+BIP_store_empty_lines (job_options_t* job_options,
+                       cups_page_header2_t* header,
+                       int empty_lines,
+                       unsigned char xormask) {
+  int bytes_per_line = job_options->bytes_per_line;
+  for (; empty_lines > 0; empty_lines--) {
+    memset (ULP_reserve (job_options, header, bytes_per_line), xormask,
+            bytes_per_line);
+    lines_waiting++;
+    if (lines_waiting >= max_lines_waiting)
+      flush_rle_buffer (job_options, header);
+  }
+}
+
+/**
+ * Store a line of pixel data in the form required by the pixel
+ * transfer mode.
+ * @param job_options   Job options
+ * @param header        Page header
+ * @param buf           Buffer containing the line; bytes_per_line long
+ */
+static inline void
+store_line (job_options_t* job_options,
+            cups_page_header2_t* header,
+            const unsigned char* buf) {
+  stats.pixel_lines++;
+  stats.pixel_bytes += job_options->bytes_per_line;
+  if (job_options->pixel_xfer == ULP)
+    ULP_store_line (job_options, header, buf);
+  else if (job_options->pixel_xfer == BIP)
+    BIP_store_line (job_options, header, buf);
+  else
+    RLE_store_line (job_options, header, buf, job_options->bytes_per_line);
+}
+
+/**
+ * Store the line last stored by store_line again.
+ * @param job_options   Job options
+ * @param header        Page header
+ */
+static inline void
+store_repeated_line (job_options_t* job_options,
+                     cups_page_header2_t* header) {
+  stats.pixel_lines++;
+  stats.repeated_lines++;
+  stats.pixel_bytes += job_options->bytes_per_line;
+  /* emit_line_buffer still holds the line */
+  if (job_options->pixel_xfer == ULP)
+    ULP_store_line (job_options, header, emit_line_buffer);
+  else if (job_options->pixel_xfer == BIP)
+    BIP_store_line (job_options, header, emit_line_buffer);
+  else
+    RLE_store_repeated_line (job_options, header);
+}
+
+/**
+ * Store a number of empty lines in the form required by the pixel
+ * transfer mode.
+ * @param job_options     Job options
+ * @param header          Page header
+ * @param empty_lines     Number of empty lines to store
+ * @param xormask         The XOR mask for negative printing
+ */
+static inline void
+store_empty_lines (job_options_t* job_options,
+                   cups_page_header2_t* header,
+                   int empty_lines,
+                   unsigned char xormask) {
+  stats.pixel_lines += empty_lines;
+  stats.empty_lines += empty_lines;
+  stats.pixel_bytes += (unsigned long long) empty_lines
+    * job_options->bytes_per_line;
+  if (job_options->pixel_xfer == ULP)
+    ULP_store_empty_lines (job_options, header, empty_lines, xormask);
+  else if (job_options->pixel_xfer == BIP)
+    BIP_store_empty_lines (job_options, header, empty_lines, xormask);
+  else
+    RLE_store_empty_lines (job_options, header, empty_lines, xormask);
+}
+
+/**
+ * Function type of store_line and its variants.
+ */
+typedef void (*store_line_fn) (job_options_t* job_options,
+			       cups_page_header2_t* header,
+			       const unsigned char* buf);
+
+/** @def RLE_FIXED_TARGET
+ * Target attribute of the store_line variants */
+/** @def RLE_FIXED_KERNELS
+ * The line_nonzero, find_repeat and find_run_end functions the
+ * store_line variants encode lines with */
+#if defined HAVE_X86_LINE_KERNELS
+#define RLE_FIXED_TARGET __attribute__ ((target ("sse2")))
+#define RLE_FIXED_KERNELS line_nonzero_sse2, find_repeat_sse2, find_run_end_sse2
+#elif defined HAVE_NEON_LINE_KERNELS
+#define RLE_FIXED_TARGET
+#define RLE_FIXED_KERNELS line_nonzero_neon, find_repeat_neon, find_run_end_neon
+#else
+#define RLE_FIXED_TARGET
+#define RLE_FIXED_KERNELS \
+  line_nonzero_scalar, find_repeat_scalar, find_run_end_first_scalar
+#endif
+
+/** @def RLE_STORE_VARIANT
+ * Define a variant of store_line for RLE lines of one printer family
+ * and bytes_per_line.  The encoder is inlined, so that the loops over
+ * the fixed line length are unrolled and the family is resolved at
+ * compile time. */
+#define RLE_STORE_VARIANT(name, QL_SERIES, BYTES_PER_LINE)		\
+  RLE_FIXED_TARGET static void						\
+  name (job_options_t* job_options, cups_page_header2_t* header,	\
+	const unsigned char* buf) {					\
+    stats.pixel_lines++;						\
+    stats.pixel_bytes += BYTES_PER_LINE;				\
+    ensure_rle_buf_space (job_options, header,				\
+			  4 + BYTES_PER_LINE + BYTES_PER_LINE / 128);	\
+    unsigned char nonzero;						\
+    unsigned char* rle_next =						\
+      RLE_encode_runs (rle_buffer_next + 3, buf, BYTES_PER_LINE,	\
+		       &nonzero, RLE_FIXED_KERNELS);			\
+    RLE_store_encoded_line (job_options, header, rle_next, nonzero,	\
+			    QL_SERIES);					\
+  }
+
+RLE_STORE_VARIANT (store_line_pt_12, false, 12)
+RLE_STORE_VARIANT (store_line_pt_14, false, 14)
+RLE_STORE_VARIANT (store_line_pt_16, false, 16)
+RLE_STORE_VARIANT (store_line_pt_48, false, 48)
+RLE_STORE_VARIANT (store_line_pt_70, false, 70)
+RLE_STORE_VARIANT (store_line_pt_90, false, 90)
+RLE_STORE_VARIANT (store_line_ql_12, true, 12)
+RLE_STORE_VARIANT (store_line_ql_14, true, 14)
+RLE_STORE_VARIANT (store_line_ql_16, true, 16)
+RLE_STORE_VARIANT (store_line_ql_48, true, 48)
+RLE_STORE_VARIANT (store_line_ql_70, true, 70)
+RLE_STORE_VARIANT (store_line_ql_90, true, 90)
+
+/**
+ * Select the function storing the pixel lines of a job.
+ * @param job_options   Job options
+ * @return              Function; the variant of store_line for the
+ *                      printer family and bytes_per_line of RLE jobs,
+ *                      if there is one, otherwise store_line
+ */
+static store_line_fn
+select_store_line_variant (job_options_t* job_options) {
+  static const struct {
+    int bytes_per_line;
+    store_line_fn pt, ql;
+  } variants [] = {
+    { 12, store_line_pt_12, store_line_ql_12 },
+    { 14, store_line_pt_14, store_line_ql_14 },
+    { 16, store_line_pt_16, store_line_ql_16 },
+    { 48, store_line_pt_48, store_line_ql_48 },
+    { 70, store_line_pt_70, store_line_ql_70 },
+    { 90, store_line_pt_90, store_line_ql_90 },
+  };
+  if (job_options->pixel_xfer != RLE)
+    return store_line;
+#ifdef HAVE_X86_LINE_KERNELS
+  if (rle_encoder != RLE_encode_sse2)
+    return store_line;  /* The CPU lacks SSE2 */
+#endif
+  unsigned i;
+  for (i = 0; i < sizeof (variants) / sizeof (variants [0]); i++)
+    if (variants [i].bytes_per_line == job_options->bytes_per_line)
+      return job_options->ql_series ? variants [i].ql : variants [i].pt;
+  return store_line;
+}
+
+/**
+ * Add data to a hash value.
+ * @param hash   Hash value of the preceding data
+ * @param data   Data to add
+ * @param len    Length of data
+ * @return       Hash value including data
+ */
+static uint64_t
+hash_data (uint64_t hash, const unsigned char* data, size_t len) {
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy (&word, data, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  for (; len > 0; data++, len--)
+    hash = (hash ^ *data) * 0x100000001b3ULL;
+  return hash;
+}
+
+/**
+ * Read a line of raster data of the current page, from page_raster
+ * if it was read ahead.  Adds the line to page_hash otherwise.
+ * @param ras     Raster data stream
+ * @param buf     Buffer for the line, unless it is used where it is
+ *                in page_raster or raster_map
+ * @param len     Length of the line
+ * @return        The line, or NULL on error
+ */
+static const unsigned char*
+read_raster_line (cups_raster_t* ras, unsigned char* buf, unsigned len) {
+  if (page_raster) {
+    if (page_raster_len - page_raster_pos < len)
+      return NULL;
+    const unsigned char* line = page_raster + page_raster_pos;
+    page_raster_pos += len;
+    return line;
+  }
+  const unsigned char* line = buf;
+  unsigned ret;
+  if (raster_map) {
+    line = map_read (len);
+    ret = line ? len : 0;
+  } else
+    ret = cupsRasterReadPixels (ras, buf, len);
+  if (ret < len) {
+    page_cacheable = false;
+    line = NULL;
+  } else
+    page_hash = hash_data (page_hash, line, len);
+  stats.raster_lines++;
+  stats.raster_bytes += ret;
+  return line;
+}
+
+/**
+ * Look up the current page in page_cache.  If a cached page has the
+ * same header, the raster data of the current page is read ahead into
+ * page_raster to compare its hash, and is then used from there.
+ * @param ras     Raster data stream
+ * @param header  Page header
+ * @return        Cache entry holding the printer data for the page,
+ *                or NULL if the page must be emitted normally
+ */
+static page_cache_entry_t*
+page_cache_lookup (cups_raster_t* ras, cups_page_header2_t* header) {
+  page_hash = 0xcbf29ce484222325ULL;
+  size_t raster_len = (size_t) header->cupsBytesPerLine * header->cupsHeight;
+  if (raster_len > PAGE_CACHE_MAX_RASTER) {
+    page_cacheable = false;
+    return NULL;
+  }
+  int i;
+  for (i = 0; i < PAGE_CACHE_ENTRIES; i++)
+    if (page_cache [i].data
+	&& memcmp (&page_cache [i].header, header, sizeof (*header)) == 0)
+      break;
+  if (i == PAGE_CACHE_ENTRIES)
+    return NULL;
+  if (raster_map) {
+    /* Mapped raster data is used where it is; a truncated page is */
+    /* left to be read line by line                                */
+    if (raster_map_len - raster_map_pos < raster_len) {
+      page_cacheable = false;
+      return NULL;
+    }
+    page_raster = map_read (raster_len);
+  } else if (grow_job_buffer (&page_raster_buffer, &page_raster_alloced,
+			      raster_len))
+    page_raster = page_raster_buffer;
+  else {
+    page_cacheable = false;
+    return NULL;
+  }
+  page_raster_len = 0;
+  page_raster_pos = 0;
+  stage_t prev_stage = stats_enter (STAGE_READ);
+  unsigned y;
+  for (y = 0; y < header->cupsHeight; y++) {
+    unsigned len = header->cupsBytesPerLine;
+    unsigned ret = len;
+    if (!raster_map)
+      ret = cupsRasterReadPixels (ras, page_raster_buffer + page_raster_len,
+				  len);
+    stats.raster_lines++;
+    stats.raster_bytes += ret;
+    if (ret < len) {
+      page_cacheable = false;
+      stats_enter (prev_stage);
+      return NULL;
+    }
+    /* Hashed line by line, as in read_raster_line */
+    page_hash = hash_data (page_hash, page_raster + page_raster_len, len);
+    page_raster_len += len;
+  }
+  stats_enter (prev_stage);
+  for (i = 0; i < PAGE_CACHE_ENTRIES; i++)
+    if (page_cache [i].data
+	&& page_cache [i].hash == page_hash
+	&& memcmp (&page_cache [i].header, header, sizeof (*header)) == 0)
+      return page_cache + i;
+  return NULL;
+}
+
+/**
+ * Start recording the printer data emitted for the current page.
+ */
+static void
+page_record_start (void) {
+  output_flush ();
+  page_record.len = 0;
+  page_record.preambles = 0;
+  page_recording = true;
+}
+
+/**
+ * Stop recording the printer data emitted for the current page, and
+ * store it in page_cache, replacing the least recently used pages if
+ * necessary.
+ * @param job_options   Job options
+ * @param header        Page header
+ */
+static void
+page_cache_store (job_options_t* job_options,
+                  cups_page_header2_t* header) {
+  if (!page_recording)
+    return;
+  output_flush ();
+  page_recording = false;
+  if (!page_cacheable)
+    return;
+  for (;;) {
+    int i, free_entry = -1, lru_entry = -1;
+    for (i = 0; i < PAGE_CACHE_ENTRIES; i++) {
+      if (!page_cache [i].data) {
+	free_entry = i;
+      } else if (lru_entry == -1
+		 || page_cache [i].last_use < page_cache [lru_entry].last_use)
+	lru_entry = i;
+    }
+    if (free_entry != -1
+	&& page_cache_bytes + page_record.len <= PAGE_CACHE_MAX_BYTES) {
+      page_cache_entry_t* entry = page_cache + free_entry;
+      *entry = page_record;
+      entry->header = *header;
+      entry->hash = page_hash;
+      entry->last_use = job_options->page;
+      page_cache_bytes += entry->len;
+      /* The entry now owns the recorded data */
+      page_record.data = NULL;
+      page_record_alloced = 0;
+      return;
+    }
+    if (lru_entry == -1)
+      return;
+    page_cache_bytes -= page_cache [lru_entry].len;
+    free (page_cache [lru_entry].data);
+    page_cache [lru_entry].data = NULL;
+  }
+}
+
+/**
+ * Emit the printer data for the current page from page_cache.
+ * @param job_options   Job options
+ * @param entry         Cache entry holding the printer data
+ */
+static void
+page_cache_emit (job_options_t* job_options, page_cache_entry_t* entry) {
+  unsigned char which_page = page_position (job_options);
+  unsigned i;
+  for (i = 0; i < entry->preambles; i++)
+    entry->data [entry->which_page [i]] = which_page;
+  output_append (entry->data, entry->len);
+  entry->last_use = job_options->page;
+  fprintf (stderr, "DEBUG: %s: Page %d emitted from page cache\n",
+	   progname, job_options->page);
+}
+
+/**
+ * Line geometry of a page, derived from the page header and the job
+ * options, and the function generating its pixel lines.  The plan is
+ * kept while consecutive pages have identical headers.
+ */
+typedef struct {
+  bool valid;                 /**< Whether the plan has been built     */
+  cups_page_header2_t header; /**< Page header the plan was built for  */
+  bool top_margin;            /**< Whether the top margin is emitted   */
+  unsigned char xormask;      /**< XOR mask for negative printing      */
+  int do_mirror;              /**< Mirror pixel data                   */
+  unsigned buflen;            /**< Raster bytes used per line          */
+  int right_padding_bytes;    /**< Zero bytes right of the pixels      */
+  int shift;                  /**< Bits to shift, see generate_emit_line */
+  unsigned top_empty_lines;   /**< Empty lines above the raster lines  */
+  unsigned bot_empty_lines;   /**< Empty lines below the raster lines  */
+  unsigned top_skip;          /**< Raster lines skipped at the top     */
+  unsigned bot_skip;          /**< Raster lines skipped at the bottom  */
+  emit_line_fn emit_line;     /**< Function generating pixel lines     */
+  store_line_fn store_line;   /**< Function storing pixel lines        */
+} line_plan_t;
+
+/** Line plan of the current page; invalidated at the start of a job. */
+line_plan_t line_plan;
+
+/**
+ * Build the line plan for a page, unless the current one was built
+ * for an identical page header.
+ * @param job_options   Job options
+ * @param header        Page header
+ * @return              Line plan
+ */
+static const line_plan_t*
+prepare_line_plan (job_options_t* job_options,
                    cups_page_header2_t* header) {
+  line_plan_t* plan = &line_plan;
+  /* Concatenated pages only have the top margin of the first page */
+  bool top_margin = !job_options->concat_pages || job_options->page == 1;
+  if (plan->valid && plan->top_margin == top_margin
+      && memcmp (&plan->header, header, sizeof (*header)) == 0)
+    return plan;
+
   unsigned char xormask = (header->NegativePrint ? ~0 : 0);
   /* Determine whether we need to mirror the pixel data */
   int do_mirror = job_options->software_mirror && job_options->mirror_print;
@@ -1373,100 +4051,687 @@ emit_raster_lines (job_options_t* job_options,
     /* Truncate buffer to fit device width */
     buflen = bytes_per_line - right_padding_bytes - shift_positive;
   }
-  /* Generate and store empty lines if the top of cupsImagingBBox */
-  /* doesn't touch the cupsPageSize box                           */
-  unsigned top_empty_lines = 0;
-  float page_size_y = header->cupsPageSize [1];
-  if (header->cupsImagingBBox [3] != 0
-      && (!job_options->concat_pages || job_options->page == 1)) {
-    float top_distance_pt
-      = page_size_y - header->cupsImagingBBox [3];
-    top_empty_lines = lrint (top_distance_pt * pt2px [1]);
+  /* Generate and store empty lines if the top of cupsImagingBBox */
+  /* doesn't touch the cupsPageSize box                           */
+  unsigned top_empty_lines = 0;
+  float page_size_y = header->cupsPageSize [1];
+  if (header->cupsImagingBBox [3] != 0 && top_margin) {
+    float top_distance_pt
+      = page_size_y - header->cupsImagingBBox [3];
+    top_empty_lines = lrint (top_distance_pt * pt2px [1]);
+  }
+
+  unsigned image_height_px = lrint (page_size_y * pt2px [1]);
+  unsigned bot_empty_lines = 0;
+  if (image_height_px >= top_empty_lines + cupsHeight)
+    bot_empty_lines = image_height_px - top_empty_lines - cupsHeight;
+
+  /*
+   * QL printers have a specific top and bottom margin that must be left blank
+   * to allow printers to skip to the next label.  For continuous-length tape,
+   * this margin is defined as the minimum value allowed for the "ESC i d"
+   * command as defined in the manuals; if a smaller value is passed, the
+   * printer rounds that up.  For die-cut labels, the margin is implicit (the
+   * "ESC i d" command is always passed a value of 0).  For most die-cut
+   * labels, the margin is the same as the minimum continuous-length tape
+   * margin, but there are a few exceptions.
+   *
+   * PT printers only support continuous-length tape.  They are documented to
+   * work like QL printers, but in practice, they all seem to allow a minimum
+   * margin of 0 as well.  The minimum margin still makes sure the tape is cut
+   * in a blank space, so use the minimum margin amounts on those printers for
+   * which we have a specification.
+   *
+   * Below, we ensure that printers for which a min_margin is defined will
+   * always have a margin at lest that wide for continuous-length tape.  For
+   * die-cut labels, we assume that the page margins are equal to the implicit
+   * margins.  For page margins that are empty, we assume min_margin; in that
+   * case, we'll end up skipping lines at the beginning and/or end of the
+   * bitmap to allow for that minimum margin.
+   */
+  unsigned top_skip = 0, bot_skip = 0;
+  unsigned min_feed = lrint (job_options->min_margin * pt2px [1]);
+  if (job_options->media == LABELS && top_empty_lines) {
+    top_empty_lines = 0;
+  } else if (top_empty_lines >= min_feed) {
+    top_empty_lines -= min_feed;
+  } else {
+    top_skip = min_feed - top_empty_lines;
+    top_empty_lines = 0;
+  }
+  if (job_options->media == LABELS && bot_empty_lines) {
+    bot_empty_lines = 0;
+  } else if (bot_empty_lines >= min_feed) {
+    bot_empty_lines -= min_feed;
+  } else {
+    bot_skip = min_feed - bot_empty_lines;
+    bot_empty_lines = 0;
+  }
+
+  plan->valid = true;
+  plan->header = *header;
+  plan->top_margin = top_margin;
+  plan->xormask = xormask;
+  plan->do_mirror = do_mirror;
+  plan->buflen = buflen;
+  plan->right_padding_bytes = right_padding_bytes;
+  plan->shift = shift;
+  plan->top_empty_lines = top_empty_lines;
+  plan->bot_empty_lines = bot_empty_lines;
+  plan->top_skip = top_skip;
+  plan->bot_skip = bot_skip;
+  plan->emit_line = select_emit_line_variant (buflen, shift, do_mirror,
+                                              xormask);
+  plan->store_line = select_store_line_variant (job_options);
+  return plan;
+}
+
+#ifdef HAVE_THREADS
+/** Kinds of lines encoded by an encoder.                */
+enum {
+  ENCODED_EMPTY,     /**< Empty line                           */
+  ENCODED_REPEATED,  /**< Same raster data as the line before  */
+  ENCODED_LINE       /**< Line stored in the encoder's arena   */
+};
+
+/**
+ * Encoder: the share of a batch of raster lines one thread transforms
+ * and encodes, and the arena it stores the encoded lines in, in the
+ * form store_line would store them (run-length encoded for RLE).
+ */
+typedef struct {
+  pthread_t thread;           /**< Thread, unless the main thread     */
+  sem_t start;                /**< Posted when a share is assigned    */
+  unsigned first;             /**< First line of the batch to encode  */
+  unsigned count;             /**< Number of lines to encode          */
+  unsigned char kind [ENCODE_BATCH_LINES]; /**< Kind of each line    */
+  unsigned short len [ENCODE_BATCH_LINES]; /**< Length of each
+                                                ENCODED_LINE          */
+  unsigned char line [0xff + 1];           /**< Pixel line buffer    */
+  unsigned char arena [ENCODE_BATCH_LINES * (4 + 0xff + 0xff / 128)];
+} encoder_t;
+
+/** Encoders; the first one is run by the main thread.   */
+encoder_t* encoders = NULL;
+/** Number of encoders.                                  */
+unsigned nencoders = 0;
+/** Posted by an encoder thread when its share is encoded. */
+sem_t encoders_done;
+/** Whether the encoder threads are to end.              */
+bool encoders_quit = false;
+/** Whether no encoder threads could be started for the job. */
+bool encoders_failed = false;
+/** Job options of the batch being encoded.              */
+job_options_t* encode_job_options;
+/** Line plan of the batch being encoded.                */
+const line_plan_t* encode_plan;
+/** Raster lines of the batch being encoded.             */
+const unsigned char** encode_lines = NULL;
+/** Raster line before the batch, or NULL at the start of a page. */
+const unsigned char* encode_prev_line;
+/** Buffer holding the raster lines of a batch read by libcups. */
+unsigned char* encode_raster = NULL;
+/** Size of encode_raster.                               */
+size_t encode_raster_alloced = 0;
+
+/**
+ * Transform and encode an encoder's share of the batch of raster lines.
+ * @param e  Encoder
+ */
+static void
+encode_share (encoder_t* e) {
+  job_options_t* job_options = encode_job_options;
+  const line_plan_t* plan = encode_plan;
+  int bytes_per_line = job_options->bytes_per_line;
+  bool rle = job_options->pixel_xfer == RLE;
+  unsigned char* next = e->arena;
+  unsigned i;
+  for (i = 0; i < e->count; i++) {
+    unsigned y = e->first + i;
+    const unsigned char* line = encode_lines [y];
+    const unsigned char* prev = y ? encode_lines [y - 1] : encode_prev_line;
+    if (prev && memcmp (line, prev, plan->buflen) == 0) {
+      e->kind [i] = ENCODED_REPEATED;
+      continue;
+    }
+    if (!plan->emit_line (line, e->line, plan->buflen, bytes_per_line,
+                          plan->right_padding_bytes, plan->shift,
+                          plan->do_mirror, plan->xormask)) {
+      e->kind [i] = ENCODED_EMPTY;
+      continue;
+    }
+    unsigned char* end;
+    if (rle) {
+      unsigned char nonzero;
+      unsigned char* rle_next = rle_encoder (next + 3, e->line,
+                                             bytes_per_line, &nonzero);
+      end = RLE_complete_line (next, rle_next, nonzero,
+                               job_options->ql_series);
+    } else {
+      memcpy (next, e->line, bytes_per_line);
+      end = next + bytes_per_line;
+    }
+    e->kind [i] = ENCODED_LINE;
+    e->len [i] = end - next;
+    next = end;
+  }
+}
+
+/**
+ * Encoder thread: encode the shares assigned to an encoder until
+ * encoders_close ends the thread.
+ * @param arg  Encoder
+ */
+static void*
+encoder_run (void* arg) {
+  encoder_t* e = arg;
+  for (;;) {
+    semaphore_wait (&e->start);
+    if (encoders_quit)
+      break;
+    encode_share (e);
+    sem_post (&encoders_done);
+  }
+  return NULL;
+}
+
+/**
+ * Start the encoder threads for the EncodeThreads option, unless they
+ * run already.  If not all threads can be started, the lines are
+ * encoded by those that were.  If none can be started, later pages do
+ * not try again.
+ * @param job_options   Job options
+ * @return              false if no encoder threads run
+ */
+static bool
+encoders_open (job_options_t* job_options) {
+  if (nencoders > 1)
+    return true;
+  if (encoders_failed)
+    return false;
+  unsigned n = job_options->encode_threads;
+  encoders = malloc (n * sizeof (*encoders));
+  encode_lines = malloc (n * ENCODE_BATCH_LINES * sizeof (*encode_lines));
+  if (!encoders || !encode_lines) {
+    free (encoders);
+    free (encode_lines);
+    encoders = NULL;
+    encode_lines = NULL;
+    fprintf (stderr, "DEBUG: %s: Cannot allocate encoders\n", progname);
+    encoders_failed = true;
+    return false;
+  }
+  encoders_quit = false;
+  sem_init (&encoders_done, 0, 0);
+  for (nencoders = 1; nencoders < n; nencoders++) {
+    encoder_t* e = &encoders [nencoders];
+    sem_init (&e->start, 0, 0);
+    if (start_thread (&e->thread, encoder_run, e) != 0) {
+      sem_destroy (&e->start);
+      break;
+    }
+  }
+  if (nencoders == 1) {
+    fprintf (stderr, "DEBUG: %s: Cannot start encoder threads\n",
+	     progname);
+    sem_destroy (&encoders_done);
+    free (encoders);
+    free (encode_lines);
+    encoders = NULL;
+    encode_lines = NULL;
+    nencoders = 0;
+    encoders_failed = true;
+    return false;
+  }
+  fprintf (stderr, "DEBUG: %s: %u encoder threads\n", progname, nencoders);
+  return true;
+}
+
+/**
+ * End the encoder threads, and free the encoders.
+ */
+static void
+encoders_close (void) {
+  encoders_failed = false;
+  if (!encoders)
+    return;
+  encoders_quit = true;
+  unsigned i;
+  for (i = 1; i < nencoders; i++) {
+    sem_post (&encoders [i].start);
+    pthread_join (encoders [i].thread, NULL);
+    sem_destroy (&encoders [i].start);
+  }
+  sem_destroy (&encoders_done);
+  free (encoders);
+  free (encode_lines);
+  free (encode_raster);
+  encoders = NULL;
+  encode_lines = NULL;
+  encode_raster = NULL;
+  encode_raster_alloced = 0;
+  nencoders = 0;
+}
+
+/**
+ * Emit the raster lines of the current page as the loop in
+ * emit_raster_lines does, reading them in batches that the encoders
+ * transform and encode in parallel.  The encoded lines are then stored
+ * in order, merging runs of empty lines across the shares.
+ * @param job_options   Job options
+ * @param ras           Raster data stream
+ * @param header        Page header
+ * @param plan          Line plan of the page
+ * @param body_lines    Number of raster lines that survive skipping
+ */
+static void
+encode_raster_lines (job_options_t* job_options,
+                     cups_raster_t* ras,
+                     cups_page_header2_t* header,
+                     const line_plan_t* plan,
+                     unsigned body_lines) {
+  unsigned cupsBytesPerLine = header->cupsBytesPerLine;
+  unsigned cupsHeight = header->cupsHeight;
+  unsigned top_skip = plan->top_skip, bot_skip = plan->bot_skip;
+  int bytes_per_line = job_options->bytes_per_line;
+  unsigned char xormask = plan->xormask;
+  unsigned batch_lines = nencoders * ENCODE_BATCH_LINES;
+  if (!grow_job_buffer (&encode_raster, &encode_raster_alloced,
+                        (size_t) batch_lines * cupsBytesPerLine)) {
+    fprintf (stderr,
+             "ERROR: Cannot allocate memory for raster line buffer\n");
+    exit (1);
+  }
+  encode_job_options = job_options;
+  encode_plan = plan;
+  encode_prev_line = NULL;
+  /* Whether the previous line was stored as a nonempty line */
+  bool prev_nonempty_line = false;
+  bool truncated = false;
+  unsigned pad_lines = 0;
+  unsigned y = 0;
+  while (y < cupsHeight && !truncated) {
+    report_progress (false);
+    /* Read a batch of lines; the line before the batch is kept in */
+    /* prev_buffer if it was read into encode_raster               */
+    stats_enter (STAGE_READ);
+    if (encode_prev_line >= encode_raster
+        && encode_prev_line < encode_raster + encode_raster_alloced) {
+      memcpy (prev_buffer, encode_prev_line, cupsBytesPerLine);
+      encode_prev_line = prev_buffer;
+    }
+    unsigned n = 0;
+    for (; n < batch_lines && y < cupsHeight; y++) {
+      const unsigned char* line =
+        read_raster_line (ras, encode_raster + (size_t) n * cupsBytesPerLine,
+                          cupsBytesPerLine);
+      if (!line) {
+        /* Pad a truncated page to the line count already announced */
+        unsigned done = y > top_skip ? y - top_skip : 0;
+        if (preamble_up_front && done < body_lines)
+          pad_lines = body_lines - done;
+        truncated = true;
+        break;
+      }
+      if (y < top_skip || y + bot_skip >= cupsHeight)
+        continue;
+      encode_lines [n++] = line;
+    }
+    /* Encode the batch, in shares of equal size */
+    stats_enter (STAGE_ENCODE);
+    unsigned share = (n + nencoders - 1) / nencoders;
+    unsigned i, started = 0;
+    for (i = 0; i < nencoders; i++) {
+      encoder_t* e = &encoders [i];
+      e->first = i * share < n ? i * share : n;
+      e->count = n - e->first < share ? n - e->first : share;
+      if (i > 0 && e->count > 0) {
+        sem_post (&e->start);
+        started++;
+      }
+    }
+    encode_share (&encoders [0]);
+    for (; started > 0; started--)
+      semaphore_wait (&encoders_done);
+    /* Store the lines in order */
+    for (i = 0; i < nencoders; i++) {
+      encoder_t* e = &encoders [i];
+      const unsigned char* p = e->arena;
+      unsigned j;
+      for (j = 0; j < e->count; j++) {
+        if (e->kind [j] == ENCODED_LINE) {
+          if (empty_lines) {
+            store_empty_lines (job_options, header, empty_lines, xormask);
+            empty_lines = 0;
+          }
+          if (job_options->pixel_xfer == RLE)
+            RLE_store_encoded_copy (job_options, header, p, e->len [j]);
+          else {
+            /* store_repeated_line takes the line from emit_line_buffer */
+            memcpy (emit_line_buffer, p, bytes_per_line);
+            store_line (job_options, header, emit_line_buffer);
+          }
+          p += e->len [j];
+          prev_nonempty_line = true;
+        } else if (e->kind [j] == ENCODED_REPEATED && prev_nonempty_line)
+          store_repeated_line (job_options, header);
+        else {
+          prev_nonempty_line = false;
+          empty_lines++;
+        }
+      }
+    }
+    if (n > 0)
+      encode_prev_line = encode_lines [n - 1];
   }
+  empty_lines += pad_lines;
+}
+#endif /* HAVE_THREADS */
 
-  unsigned image_height_px = lrint (page_size_y * pt2px [1]);
-  unsigned bot_empty_lines = 0;
-  if (image_height_px >= top_empty_lines + cupsHeight)
-    bot_empty_lines = image_height_px - top_empty_lines - cupsHeight;
+/**
+ * Emit raster lines for current page.
+ * @param job_options   Job options
+ * @param ras           Raster data stream
+ * @param header        Page header
+ * @return              0 on success, nonzero otherwise
+ */
+int
+emit_raster_lines (job_options_t* job_options,
+                   cups_raster_t* ras,
+                   cups_page_header2_t* header) {
+  const line_plan_t* plan = prepare_line_plan (job_options, header);
+  unsigned char xormask = plan->xormask;
+  int do_mirror = plan->do_mirror;
+  unsigned cupsBytesPerLine = header->cupsBytesPerLine;
+  unsigned cupsHeight = header->cupsHeight;
+  int bytes_per_line = job_options->bytes_per_line;
+  unsigned buflen = plan->buflen;
+  int right_padding_bytes = plan->right_padding_bytes;
+  int shift = plan->shift;
+  unsigned top_empty_lines = plan->top_empty_lines;
+  unsigned bot_empty_lines = plan->bot_empty_lines;
+  unsigned top_skip = plan->top_skip, bot_skip = plan->bot_skip;
+  emit_line_fn emit_line = plan->emit_line;
+  store_line_fn store_pixel_line = plan->store_line;
 
-  /*
-   * QL printers have a specific top and bottom margin that must be left blank
-   * to allow printers to skip to the next label.  For continuous-length tape,
-   * this margin is defined as the minimum value allowed for the "ESC i d"
-   * command as defined in the manuals; if a smaller value is passed, the
-   * printer rounds that up.  For die-cut labels, the margin is implicit (the
-   * "ESC i d" command is always passed a value of 0).  For most die-cut
-   * labels, the margin is the same as the minimum continuous-length tape
-   * margin, but there are a few exceptions.
-   *
-   * PT printers only support continuous-length tape.  They are documented to
-   * work like QL printers, but in practice, they all seem to allow a minimum
-   * margin of 0 as well.  The minimum margin still makes sure the tape is cut
-   * in a blank space, so use the minimum margin amounts on those printers for
-   * which we have a specification.
-   *
-   * Below, we ensure that printers for which a min_margin is defined will
-   * always have a margin at lest that wide for continuous-length tape.  For
-   * die-cut labels, we assume that the page margins are equal to the implicit
-   * margins.  For page margins that are empty, we assume min_margin; in that
-   * case, we'll end up skipping lines at the beginning and/or end of the
-   * bitmap to allow for that minimum margin.
-   */
-  unsigned top_skip = 0, bot_skip = 0;
-  unsigned min_feed = lrint (job_options->min_margin * pt2px [1]);
-  if (job_options->media == LABELS && top_empty_lines) {
-    top_empty_lines = 0;
-  } else if (top_empty_lines >= min_feed) {
-    top_empty_lines -= min_feed;
-  } else {
-    top_skip = min_feed - top_empty_lines;
-    top_empty_lines = 0;
-  }
-  if (job_options->media == LABELS && bot_empty_lines) {
-    bot_empty_lines = 0;
-  } else if (bot_empty_lines >= min_feed) {
-    bot_empty_lines -= min_feed;
-  } else {
-    bot_skip = min_feed - bot_empty_lines;
-    bot_empty_lines = 0;
+  /* Number of raster lines that survive skipping */
+  unsigned body_lines = 0;
+  if (cupsHeight > top_skip + bot_skip)
+    body_lines = cupsHeight - top_skip - bot_skip;
+  /* The label preamble precedes the first band, so the number of   */
+  /* lines in the page must be known before any line is encoded;    */
+  /* concatenated pages are announced together, once, if counted    */
+  if (!job_options->concat_pages) {
+    page_lines = top_empty_lines + body_lines + bot_empty_lines;
+    preamble_emitted = false;
+    /* A cached page sets the compression mode it was recorded with */
+    wire_compression = -1;
   }
-
-  progress.page = job_options->page;
-  progress.height = cupsHeight;
+  progress.lines += top_empty_lines + body_lines + bot_empty_lines;
 
   /* Generate and store actual page data */
   empty_lines += top_empty_lines;
-  int y;
-  for (y = 0; y < cupsHeight; y++) {
-    /* Feedback to the user */
-    progress.completed = y;
+  /* Whether prev_line holds the previous line, and that line
+     was stored as a nonempty line */
+  bool have_prev_line = false, prev_nonempty_line = false;
+  const unsigned char* prev_line = NULL;
+  int y = 0;
+  /* Tall pages may be encoded in parallel, instead of line by line */
+#ifdef HAVE_THREADS
+  if (job_options->encode_threads > 1
+      && cupsHeight >= ENCODE_THREADS_MIN_LINES
+      && encoders_open (job_options)) {
+    encode_raster_lines (job_options, ras, header, plan, body_lines);
+    y = cupsHeight;  /* The loop below has nothing left to do */
+  }
+#endif
+  for (; y < cupsHeight; y++) {
+    /* Feedback to the user, from the lines delivered so far */
+    if (y % PROGRESS_CHECK_LINES == 0)
+      report_progress (false);
     /* Read one line of pixels */
-    if (cupsRasterReadPixels (ras, buffer, cupsBytesPerLine) < 1)
+    stats_enter (STAGE_READ);
+    const unsigned char* line = read_raster_line (ras, buffer,
+                                                  cupsBytesPerLine);
+    if (!line) {
+      /* Pad a truncated page to the line count already announced */
+      unsigned done = y > top_skip ? y - top_skip : 0;
+      if (preamble_up_front && done < body_lines)
+        empty_lines += body_lines - done;
       break;  /* Escape if no pixels read */
+    }
     if (y < top_skip || y + bot_skip >= cupsHeight)
       continue;
+    /* A line generating the same pixel data as the previous line is */
+    /* stored the same way (only the first buflen bytes are used)    */
+    stats_enter (STAGE_TRANSFORM);
+    if (have_prev_line && memcmp (line, prev_line, buflen) == 0) {
+      if (prev_nonempty_line) {
+        stats_enter (STAGE_ENCODE);
+        store_repeated_line (job_options, header);
+      } else
+        empty_lines++;
+      continue;
+    }
     bool nonempty_line =
-      generate_emit_line (buffer, emit_line_buffer, buflen, bytes_per_line,
-                          right_padding_bytes, shift, do_mirror, xormask);
+      emit_line (line, emit_line_buffer, buflen, bytes_per_line,
+                 right_padding_bytes, shift, do_mirror, xormask);
+    stats_enter (STAGE_ENCODE);
     if (nonempty_line) {
       if (empty_lines) {
-        RLE_store_empty_lines
-          (job_options, header, empty_lines, xormask);
+        store_empty_lines (job_options, header, empty_lines, xormask);
         empty_lines = 0;
       }
-      RLE_store_line (job_options, header,
-                      emit_line_buffer, bytes_per_line);
+      store_pixel_line (job_options, header, emit_line_buffer);
     } else
       empty_lines++;
+    /* A line read into buffer is kept in prev_buffer; mapped or */
+    /* read ahead lines stay where they are                      */
+    if (line == buffer) {
+      unsigned char* tmp = prev_buffer;
+      prev_buffer = buffer;
+      buffer = tmp;
+    }
+    prev_line = line;
+    have_prev_line = true;
+    prev_nonempty_line = nonempty_line;
   }
-  progress.completed = cupsHeight;
-  report_progress (0);
+  stats_enter (STAGE_OTHER);
 
   if (bot_empty_lines != 0 && !job_options->concat_pages)
     empty_lines += bot_empty_lines;
   return 0;
 }
 
+/**
+ * Read the page header of the next page.
+ * @param ras     Raster data stream
+ * @param header  Page header
+ * @return        false if there are no more pages
+ */
+static bool
+read_page_header (cups_raster_t* ras, cups_page_header2_t* header) {
+  stage_t prev_stage = stats_enter (STAGE_READ);
+  bool ret = raster_map ? map_read_header (header)
+    : cupsRasterReadHeader2 (ras, header);
+  stats_enter (prev_stage);
+  return ret;
+}
+
+/**
+ * Make a file standard input.
+ * @param name  File name
+ * @return      false if the file cannot be opened
+ */
+static bool
+open_input (const char* name) {
+  int fd = open (name, O_RDONLY);
+  if (fd < 0) {
+    fprintf (stderr, "ERROR: %s: %s: %s\n", progname, name,
+	     strerror (errno));
+    return false;
+  }
+  dup2 (fd, 0);
+  close (fd);
+  return true;
+}
+
+/**
+ * Read the page header of the next page of the job.  At the end of
+ * each input, go on with the next batch input that can be opened.
+ * @param ras     Raster data stream, replaced for the next input
+ * @param header  Page header
+ * @return        false if there are no more pages
+ */
+static bool
+read_job_page_header (cups_raster_t** ras, cups_page_header2_t* header) {
+  while (!read_page_header (*ras, header)) {
+    if (batch_next >= batch_ninputs)
+      return false;
+    if (*ras)
+      cupsRasterClose (*ras);
+    *ras = NULL;
+    unmap_raster_input ();
+    for (;;) {
+      if (batch_next >= batch_ninputs)
+	return false;
+      if (open_input (batch_inputs [batch_next++]))
+	break;
+    }
+    fprintf (stderr, "DEBUG: %s: Batch input %u of %u: %s\n", progname,
+	     batch_next, batch_ninputs, batch_inputs [batch_next - 1]);
+    *ras = map_raster_input () ? NULL : cupsRasterOpen (0, CUPS_RASTER_READ);
+  }
+  return true;
+}
+
+/**
+ * Copy standard input to a temporary file, which becomes standard
+ * input, so that it can be read twice.
+ * @return  false if the temporary file cannot be written
+ */
+static bool
+spool_input (void) {
+  FILE* tmp = tmpfile ();
+  if (!tmp)
+    return false;
+  int fd = fileno (tmp);
+  unsigned char block [0x10000];
+  ssize_t len;
+  for (;;) {
+    len = read (0, block, sizeof (block));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      break;
+    unsigned char* p = block;
+    while (len > 0) {
+      ssize_t ret = write (fd, p, len);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0) {
+        fclose (tmp);
+        return false;
+      }
+      p += ret;
+      len -= ret;
+    }
+  }
+  if (len < 0 || lseek (fd, 0, SEEK_SET) != 0 || dup2 (fd, 0) < 0) {
+    fclose (tmp);
+    return false;
+  }
+  /* Standard input keeps the file open */
+  fclose (tmp);
+  return true;
+}
+
+/**
+ * Count the pixel lines of all pages of a ConcatPages job ahead of
+ * the job, so that the label preamble can announce them before the
+ * first line, and the lines can be sent while the job is read instead
+ * of all being held back until the last page.  The raster data is
+ * read twice; input that cannot be read twice is spooled to a
+ * temporary file first.
+ *
+ * The lines are counted as process_rasterdata emits them: the top
+ * margin of the first page, the raster lines not skipped, and the
+ * bottom margin of the last page, which replaces the empty lines at
+ * the end of the last page.
+ * @param job_options  Job options
+ * @return             false if the lines cannot be counted
+ */
+static bool
+count_concat_lines (job_options_t* job_options) {
+  struct stat st;
+  if ((fstat (0, &st) != 0 || !S_ISREG (st.st_mode)) && !spool_input ()) {
+    fprintf (stderr, "DEBUG: %s: Cannot spool input: %s\n", progname,
+             strerror (errno));
+    return false;
+  }
+  off_t start = lseek (0, 0, SEEK_CUR);
+  int fd = dup (0);
+  cups_raster_t* ras = fd >= 0 ? cupsRasterOpen (fd, CUPS_RASTER_READ) : NULL;
+  if (start < 0 || !ras) {
+    if (fd >= 0)
+      close (fd);
+    return false;
+  }
+  stage_t prev_stage = stats_enter (STAGE_READ);
+  cups_page_header2_t header;
+  unsigned char* line = NULL;
+  size_t line_alloced = 0;
+  unsigned lines = 0, pending = 0, pages = 0;
+  float bot_margin = 0.0;
+  bool ok = true;
+  while (ok && cupsRasterReadHeader2 (ras, &header)) {
+    job_options->page = ++pages;
+    const line_plan_t* plan = prepare_line_plan (job_options, &header);
+    unsigned cupsHeight = header.cupsHeight;
+    unsigned body_lines = 0;
+    if (cupsHeight > plan->top_skip + plan->bot_skip)
+      body_lines = cupsHeight - plan->top_skip - plan->bot_skip;
+    if (!grow_job_buffer (&line, &line_alloced, header.cupsBytesPerLine)) {
+      ok = false;
+      break;
+    }
+    pending += plan->top_empty_lines;
+    unsigned y;
+    for (y = 0; y < cupsHeight; y++) {
+      if (cupsRasterReadPixels (ras, line, header.cupsBytesPerLine) < 1) {
+        /* A truncated page is padded, see emit_raster_lines */
+        unsigned done = y > plan->top_skip ? y - plan->top_skip : 0;
+        if (done < body_lines)
+          pending += body_lines - done;
+        break;
+      }
+      if (y < plan->top_skip || y + plan->bot_skip >= cupsHeight)
+        continue;
+      /* Empty as for generate_emit_line: only buflen bytes are used */
+      unsigned i;
+      unsigned char nonzero = 0;
+      for (i = 0; i < plan->buflen; i++)
+        nonzero |= line [i];
+      if (nonzero) {
+        lines += pending + 1;
+        pending = 0;
+      } else
+        pending++;
+    }
+    bot_margin = header.cupsImagingBBox [1] * (header.HWResolution [1] / 72.0);
+  }
+  free (line);
+  cupsRasterClose (ras);
+  close (fd);
+  stats_enter (prev_stage);
+  if (lseek (0, start, SEEK_SET) != start || !ok || pages == 0)
+    return false;
+  page_lines = lines + lrint (bot_margin);
+  counted_pages = pages;
+  job_options->page = 1;
+  return true;
+}
+
 /**
  * Process CUPS raster data from input file, emitting printer data on
  * stdout.
@@ -1481,14 +4746,64 @@ process_rasterdata (job_options_t* job_options) {
   cups_page_header2_t *header = headers + 1;
   cups_page_header2_t *tmp_header;
 
-  ras = cupsRasterOpen (0, CUPS_RASTER_READ);
+  memset (&stats, 0, sizeof (stats));
+  stats.start = stats.stage_start = monotonic_time ();
+  stats_timing = job_options->statistics;
+  line_plan.valid = false;
+  preamble_template.valid = false;
+  memset (&progress, 0, sizeof (progress));
+  progress.reported = stats.start;
+
+  /* A preamble emitted ahead of the page's lines cannot count the */
+  /* lines of pages still to come, nor know if this is the last one, */
+  /* unless the concatenated pages have been counted                 */
+  counted_pages = 0;
+  preamble_emitted = false;
+  wire_compression = -1;
+  /* Batch inputs are not counted together */
+  if (job_options->label_preamble && job_options->concat_pages
+      && batch_next >= batch_ninputs)
+    count_concat_lines (job_options);
+  bool preamble_needs_page_end = job_options->label_preamble
+    && (job_options->concat_pages ? !counted_pages
+        : job_options->last_page_flag);
+  if (job_options->band_height > 0) {
+    if (job_options->bip_strips > 1)
+      fprintf (stderr, "DEBUG: %s: BandHeight ignored with BipStrips\n",
+	       progname);
+    else if (preamble_needs_page_end)
+      fprintf (stderr, "DEBUG: %s: BandHeight ignored with LabelPreamble "
+	       "and uncounted ConcatPages or LastPageFlag\n", progname);
+    else
+      max_lines_waiting = job_options->band_height;
+  }
+  /* ULP lines only need to be held back for such a preamble */
+  ulp_direct = job_options->pixel_xfer == ULP && !preamble_needs_page_end;
+  preamble_up_front = job_options->label_preamble
+    && (max_lines_waiting != INT_MAX || ulp_direct || counted_pages);
+
+  printer_idle = state_file_start_job (job_options);
+  printer_reset = false;
+#ifdef HAVE_CUPSBACKCHANNELREAD
+  /* The reply must be read before the output writer takes over */
+  if (job_options->status_check)
+    request_printer_status (job_options);
+#else
+  if (job_options->status_check)
+    fprintf (stderr, "DEBUG: %s: StatusCheck not supported\n", progname);
+#endif
+  ras = pipeline_open (job_options);
   for (job_options->page = 1,
-         job_options->last_page = ! cupsRasterReadHeader2 (ras, header);
+         job_options->last_page = ! read_job_page_header (&ras, header);
        ! job_options->last_page;
        tmp_header = next_header,
          next_header = header,
          header = tmp_header,
 	 job_options->page++) {
+    progress.page = job_options->page;
+    /* Concatenated pages are delivered, and counted, together */
+    if (!job_options->concat_pages)
+      progress.lines = progress.delivered = 0;
     float pt2px[] = {
       header->HWResolution [0] / 72.0,
       header->HWResolution [1] / 72.0
@@ -1517,53 +4832,96 @@ process_rasterdata (job_options_t* job_options) {
     fprintf (stderr, "DEBUG: %s: NegativePrint: %d\n",
 	     progname, header->NegativePrint);
     page_prepare (header->cupsBytesPerLine, bytes_per_line);
+    reserve_rle_buffer (job_options, header);
     if (job_options->page == 1) {
+#ifdef HAVE_CUPSBACKCHANNELREAD
+      check_media_width (header);
+#endif
       emit_job_cmds (job_options);
       emit_page_cmds (job_options, header);
     }
-    emit_raster_lines (job_options, ras, header);
+    /* Pages are emitted independently unless they are concatenated, */
+    /* so the printer data of identical pages can be reused          */
+    page_cache_entry_t* cached = NULL;
+    page_cacheable = !job_options->concat_pages;
+    if (page_cacheable)
+      cached = page_cache_lookup (ras, header);
+    if (!cached) {
+      if (page_cacheable)
+	page_record_start ();
+      emit_raster_lines (job_options, ras, header);
+    }
     unsigned char xormask = (header->NegativePrint ? ~0 : 0);
     /* Determine whether this is the last page (fetch next)    */
-    job_options->last_page = ! cupsRasterReadHeader2 (ras, next_header);
+    job_options->last_page = ! read_job_page_header (&ras, next_header);
+    if (cached) {
+      page_cache_emit (job_options, cached);
+      stats.cached_pages++;
+    } else if (!job_options->concat_pages) {
+      store_empty_lines (job_options, header, empty_lines, xormask);
+      empty_lines = 0;
+      flush_rle_buffer (job_options, header);
+      page_cache_store (job_options, header);
+    } else if (job_options->last_page) {
+      unsigned bot_empty_lines
+	= lrint (header->cupsImagingBBox [1] * pt2px [1]);
+      empty_lines = bot_empty_lines;
+      store_empty_lines (job_options, header, empty_lines, xormask);
+      empty_lines = 0;
+      flush_rle_buffer (job_options, header);
+    }
     if (! job_options->last_page) {
       if (!job_options->concat_pages) {
-        RLE_store_empty_lines
-          (job_options, header, empty_lines, xormask);
-        empty_lines = 0;
-        flush_rle_buffer (job_options, header);
 	/* Emit page end marker without feed */
-        putchar (PTC_FORMFEED);
+        output_byte (PTC_FORMFEED);
+        output_flush ();
+        poll_printer_status ();
       }
     } else {
-      if (!job_options->concat_pages) {
-        RLE_store_empty_lines
-          (job_options, header, empty_lines, xormask);
-        empty_lines = 0;
-        flush_rle_buffer (job_options, header);
-      } else {
-        unsigned bot_empty_lines
-          = lrint (header->cupsImagingBBox [1] * pt2px [1]);
-        empty_lines = bot_empty_lines;
-        RLE_store_empty_lines
-          (job_options, header, empty_lines, xormask);
-        empty_lines = 0;
-        flush_rle_buffer (job_options, header);
-      }
       /* Emit end-of-job command */
-      putchar (PTC_EJECT);
+      output_byte (PTC_EJECT);
+      output_flush ();
+    }
+    /* The page has been handed to the printer as a whole */
+    if (!job_options->concat_pages || job_options->last_page) {
+      progress.delivered = progress.lines;
+      report_progress (true);
     }
     page_end ();
     /* Emit page count according to CUPS requirements */
     fprintf (stderr, "PAGE: %d 1\n", job_options->page);
+    stats.pages++;
   }
+  unmap_raster_input ();
+#ifdef HAVE_THREADS
+  encoders_close ();
+#endif
+  pipeline_close ();
+  /* The job ended with PTC_EJECT, or did not reach the printer */
+  if (job_options->state_file [0] && (stats.pages > 0 || printer_idle))
+    state_file_write (job_options, "clean\n");
+  fprintf (stderr, "DEBUG: %s: Statistics: ", progname);
+  stats_write_json (stderr);
+  free_job_buffers ();
 }
 
+/* ptbench includes this file to benchmark the functions above */
+#ifndef RASTERTOPTCH_NO_MAIN
 static void help (void) {
-  printf ("Usage: %s [options] {job-options}\n"
+  printf ("Usage: %s [options] {job-options} [FILE...]\n"
+	  "\n"
+	  "Reads the raster data of the FILEs one after the other as the\n"
+	  "pages of one job, or standard input if there are no FILEs.\n"
 	  "\n"
 	  "Options:\n"
-	  "  -i, --input=NAME   read from NAME instead of standard input\n"
+	  "  -i, --input=NAME   read from NAME before the FILEs\n"
+	  "  -b, --batch=NAME   read the names of more FILEs from NAME,\n"
+	  "                     one per line\n"
 	  "  -o, --output=NAME  write to NAME instead of standard output\n"
+	  "  -s, --stats=NAME   write job statistics to NAME as JSON\n"
+	  "  -d, --daemon=NAME  serve jobs on UNIX socket NAME; each job\n"
+	  "                     sends {job-options} on a line, followed\n"
+	  "                     by the raster data\n"
 	  "  -h, --help         display this help and exit\n",
 	  progname);
 }
@@ -1573,6 +4931,298 @@ static void fail_bad_options () {
   exit (2);
 }
 
+/**
+ * Run a print job on standard input and output.
+ * @param job_options  Job options
+ * @param stats_file   Stream to write the job statistics to, or NULL
+ */
+static void
+run_job (job_options_t* job_options, FILE* stats_file) {
+  process_rasterdata (job_options);
+
+  if (stats_file) {
+    stats_write_json (stats_file);
+    fclose (stats_file);
+  }
+}
+
+#ifdef HAVE_DAEMON
+/** Maximum length of the {job-options} line of a daemon job. */
+#define DAEMON_MAX_OPTIONS 4096
+/** Maximum number of daemon jobs running at the same time. */
+#define DAEMON_MAX_JOBS 32
+/** Number of parsed {job-options} strings the daemon keeps. */
+#define OPTIONS_CACHE_ENTRIES 16
+
+/**
+ * Parsed {job-options} string, kept by the daemon.
+ */
+typedef struct {
+  char* str;                  /**< {job-options} string (NULL = unused) */
+  job_options_t options;      /**< Options parsed from str              */
+} options_cache_entry_t;
+
+/**
+ * Message from a daemon job reporting the options it parsed.  Sent in
+ * a single write of at most PIPE_BUF bytes, so that messages of jobs
+ * running at the same time do not mix.
+ */
+typedef struct {
+  unsigned len;               /**< Length of str                        */
+  job_options_t options;      /**< Options parsed from str              */
+  char str [];                /**< {job-options} string                 */
+} options_message_t;
+
+/** Parsed {job-options} strings of earlier daemon jobs. */
+options_cache_entry_t options_cache [OPTIONS_CACHE_ENTRIES];
+/** Next options_cache entry to replace.                 */
+int options_cache_next = 0;
+/** Processes running daemon jobs (0 = unused).          */
+volatile pid_t daemon_jobs [DAEMON_MAX_JOBS];
+/** Number of processes in daemon_jobs.                  */
+volatile sig_atomic_t daemon_njobs = 0;
+/** Name of the daemon socket, removed when stopping.    */
+const char* daemon_socket_name;
+
+/**
+ * Find a {job-options} string in options_cache.
+ * @param str  {job-options} string
+ * @return     Cache entry, or NULL
+ */
+static options_cache_entry_t*
+options_cache_lookup (const char* str) {
+  int i;
+  for (i = 0; i < OPTIONS_CACHE_ENTRIES; i++)
+    if (options_cache [i].str && strcmp (options_cache [i].str, str) == 0)
+      return options_cache + i;
+  return NULL;
+}
+
+/**
+ * Add options reported by a daemon job to options_cache.
+ * @param msg  Message from the job
+ */
+static void
+options_cache_store (const options_message_t* msg) {
+  char* str = strndup (msg->str, msg->len);
+  if (!str || options_cache_lookup (str)) {
+    free (str);
+    return;
+  }
+  options_cache_entry_t* entry = options_cache + options_cache_next;
+  options_cache_next = (options_cache_next + 1) % OPTIONS_CACHE_ENTRIES;
+  free (entry->str);
+  entry->str = str;
+  entry->options = msg->options;
+}
+
+/**
+ * Reap the processes of finished daemon jobs (SIGCHLD handler).
+ */
+static void
+daemon_reap (int signal) {
+  int saved_errno = errno;
+  pid_t pid;
+  while ((pid = waitpid (-1, NULL, WNOHANG)) > 0) {
+    int i;
+    for (i = 0; i < DAEMON_MAX_JOBS; i++)
+      if (daemon_jobs [i] == pid) {
+	daemon_jobs [i] = 0;
+	daemon_njobs--;
+      }
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Cancel all daemon jobs and stop the daemon (SIGTERM handler).
+ */
+static void
+daemon_stop (int signal) {
+  int i;
+  for (i = 0; i < DAEMON_MAX_JOBS; i++)
+    if (daemon_jobs [i] > 0)
+      kill (daemon_jobs [i], SIGTERM);
+  unlink (daemon_socket_name);
+  _exit (0);
+}
+
+/**
+ * Run a daemon job in a process forked from the daemon.  The
+ * connection becomes standard input and output.
+ * @param conn        Connection to the client
+ * @param report_fd   Pipe for reporting parsed options to the daemon
+ * @param stats_file  Stream to write the job statistics to, or NULL
+ */
+static void
+daemon_job (int conn, int report_fd, FILE* stats_file) {
+  dup2 (conn, 0);
+  dup2 (conn, 1);
+  close (conn);
+
+  /* Read the {job-options} line byte by byte, to leave the raster */
+  /* data for cupsRasterOpen                                      */
+  char str [DAEMON_MAX_OPTIONS];
+  unsigned len = 0;
+  for (;;) {
+    ssize_t ret = read (0, str + len, 1);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      fprintf (stderr, "ERROR: %s: {job-options} line missing\n", progname);
+      exit (2);
+    }
+    if (str [len] == '\n')
+      break;
+    if (++len == sizeof (str)) {
+      fprintf (stderr, "ERROR: %s: {job-options} line too long\n",
+	       progname);
+      exit (2);
+    }
+  }
+  str [len] = '\0';
+
+  job_options_t job_options;
+  options_cache_entry_t* cached = options_cache_lookup (str);
+  if (cached)
+    job_options = cached->options;
+  else {
+    job_options = parse_job_options (str);
+    /* Let the daemon skip parsing the string for later jobs */
+    union {
+      options_message_t msg;
+      char buf [PIPE_BUF];
+    } report;
+    if (sizeof (report.msg) + len <= sizeof (report)) {
+      report.msg.len = len;
+      report.msg.options = job_options;
+      memcpy (report.msg.str, str, len);
+      if (write (report_fd, &report, sizeof (report.msg) + len) < 0)
+	fprintf (stderr, "DEBUG: %s: Cannot report job options: %s\n",
+		 progname, strerror (errno));
+    }
+  }
+  close (report_fd);
+  if (stats_file)
+    job_options.statistics = true;
+  fprintf (stderr, "DEBUG: %s: job options: %s\n", progname, str);
+
+  run_job (&job_options, stats_file);
+  exit (0);
+}
+
+/**
+ * Serve print jobs on a UNIX socket, running each job in a process of
+ * its own.  Does not return.
+ * @param socket_name  Name of the socket
+ * @param stats_file   Stream to write the statistics of each job to,
+ *                     one line per job, or NULL
+ */
+static void
+run_daemon (const char* socket_name, FILE* stats_file) {
+  struct sockaddr_un addr = { };
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_name) >= sizeof (addr.sun_path)) {
+    fprintf (stderr, "%s: %s: Socket name too long\n", progname, socket_name);
+    exit (1);
+  }
+  strcpy (addr.sun_path, socket_name);
+  int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  unlink (socket_name);
+  if (sock < 0
+      || bind (sock, (struct sockaddr*) &addr, sizeof (addr)) < 0
+      || listen (sock, DAEMON_MAX_JOBS) < 0) {
+    fprintf (stderr, "%s: %s: %s\n", progname, socket_name, strerror(errno));
+    exit (1);
+  }
+  int report_pipe [2];
+  if (pipe (report_pipe) < 0) {
+    fprintf (stderr, "%s: Cannot create pipe: %s\n", progname,
+	     strerror (errno));
+    exit (1);
+  }
+  daemon_socket_name = socket_name;
+
+  struct sigaction action;
+  memset (&action, 0, sizeof (action));
+  sigemptyset (&action.sa_mask);
+  action.sa_handler = daemon_reap;
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction (SIGCHLD, &action, NULL);
+  action.sa_handler = daemon_stop;
+  action.sa_flags = 0;
+  sigaction (SIGTERM, &action, NULL);
+  /* A client going away makes its job fail writing, not vanish */
+  signal (SIGPIPE, SIG_IGN);
+  sigset_t chld, old;
+  sigemptyset (&chld);
+  sigaddset (&chld, SIGCHLD);
+  sigaddset (&chld, SIGTERM);
+
+  fprintf (stderr, "DEBUG: %s: Serving jobs on %s\n", progname, socket_name);
+  for (;;) {
+    /* Wait for a connection, or for a job reporting parsed options */
+    struct pollfd fds [2] = {
+      { sock, POLLIN }, { report_pipe [0], POLLIN }
+    };
+    if (poll (fds, 2, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf (stderr, "%s: poll: %s\n", progname, strerror (errno));
+      exit (1);
+    }
+    if (fds [1].revents & POLLIN) {
+      union {
+	options_message_t msg;
+	char buf [PIPE_BUF];
+      } report;
+      ssize_t ret = read (report_pipe [0], &report, sizeof (report));
+      if (ret >= (ssize_t) sizeof (report.msg)
+	  && ret == sizeof (report.msg) + report.msg.len)
+	options_cache_store (&report.msg);
+    }
+    if (!(fds [0].revents & POLLIN))
+      continue;
+
+    sigprocmask (SIG_BLOCK, &chld, &old);
+    while (daemon_njobs >= DAEMON_MAX_JOBS)
+      sigsuspend (&old);
+    sigprocmask (SIG_SETMASK, &old, NULL);
+    int conn = accept (sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno != EINTR)
+	fprintf (stderr, "DEBUG: %s: accept: %s\n", progname,
+		 strerror (errno));
+      continue;
+    }
+
+    sigprocmask (SIG_BLOCK, &chld, &old);
+    pid_t pid = fork ();
+    if (pid == 0) {
+      /* The job is cancelled as a filter run by CUPS is */
+      signal (SIGTERM, SIG_DFL);
+      signal (SIGCHLD, SIG_DFL);
+      sigprocmask (SIG_SETMASK, &old, NULL);
+      close (sock);
+      close (report_pipe [0]);
+      daemon_job (conn, report_pipe [1], stats_file);
+    }
+    if (pid < 0)
+      fprintf (stderr, "ERROR: %s: Cannot start job: %s\n", progname,
+	       strerror (errno));
+    else {
+      int i;
+      for (i = 0; daemon_jobs [i]; i++)
+	;
+      daemon_jobs [i] = pid;
+      daemon_njobs++;
+    }
+    sigprocmask (SIG_SETMASK, &old, NULL);
+    close (conn);
+  }
+}
+#endif /* HAVE_DAEMON */
+
 /**
  * Main entry function.
  * @param argc  number of command line arguments plus one
@@ -1584,16 +5234,22 @@ main (int argc, char* argv []) {
   progname = basename (argv[0]);
   const char *input_filename = NULL;
   const char *output_filename = NULL;
+  const char *stats_filename = NULL;
+  const char *daemon_name = NULL;
+  const char *batch_filename = NULL;
 
   for (;;) {
     static struct option long_options[] = {
       { "input",  1, NULL, 'i' },
       { "output",  1, NULL, 'o' },
+      { "stats",  1, NULL, 's' },
+      { "daemon", 1, NULL, 'd' },
+      { "batch",  1, NULL, 'b' },
       { "help",   0, NULL, 'h' },
       { }
     };
 
-    int c = getopt_long (argc, argv, "hi:o:", long_options, NULL);
+    int c = getopt_long (argc, argv, "hi:o:s:d:b:", long_options, NULL);
     if (c == -1)
       break;
 
@@ -1610,28 +5266,102 @@ main (int argc, char* argv []) {
       output_filename = optarg;
       break;
 
+    case 's':  /* --stats=NAME */
+      stats_filename = optarg;
+      break;
+
+    case 'd':  /* --daemon=NAME */
+      daemon_name = optarg;
+      break;
+
+    case 'b':  /* --batch=NAME */
+      batch_filename = optarg;
+      break;
+
     case '?':  /* unknown option or missing argument */
       fail_bad_options ();
     }
   }
 
+  FILE* stats_file = NULL;
+  if (stats_filename) {
+    stats_file = fopen (stats_filename, "w");
+    if (!stats_file) {
+      fprintf (stderr, "%s: %s: %s\n", progname, stats_filename, strerror(errno));
+      exit (1);
+    }
+  }
+
+  if (daemon_name) {
+#ifdef HAVE_DAEMON
+    select_line_kernels ();
+    run_daemon (daemon_name, stats_file);
+#else
+    fprintf (stderr, "%s: Daemon mode not supported\n", progname);
+    exit (1);
+#endif
+  }
+
   if (optind >= argc) {
     fprintf (stderr, "%s: {job-options} argument missing\n", progname);
     fail_bad_options ();
   }
 
   job_options_t job_options = parse_job_options (argv [optind]);
+  if (stats_file)
+    job_options.statistics = true;
 
   fprintf(stderr, "DEBUG: %s: job options: %s\n", progname, argv [optind]);
 
-  if (input_filename) {
-    int fd = open (input_filename, O_RDONLY);
-    if (fd < 0) {
-      fprintf (stderr, "%s: %s: %s\n", progname, input_filename, strerror(errno));
+  /* Collect the inputs: --input, the FILEs, then the --batch list */
+  unsigned alloced = argc;
+  batch_inputs = malloc (alloced * sizeof (char*));
+  if (!batch_inputs) {
+    fprintf (stderr, "%s: Cannot allocate memory\n", progname);
+    exit (1);
+  }
+  if (input_filename)
+    batch_inputs [batch_ninputs++] = (char*) input_filename;
+  int i;
+  for (i = optind + 1; i < argc; i++)
+    batch_inputs [batch_ninputs++] = argv [i];
+  if (batch_filename) {
+    FILE* f = fopen (batch_filename, "r");
+    if (!f) {
+      fprintf (stderr, "%s: %s: %s\n", progname, batch_filename, strerror(errno));
       exit (1);
     }
-    dup2 (fd, 0);
-    close (fd);
+    char* line = NULL;
+    size_t line_alloced = 0;
+    ssize_t len;
+    while ((len = getline (&line, &line_alloced, f)) >= 0) {
+      if (len > 0 && line [len - 1] == '\n')
+	line [--len] = '\0';
+      if (len == 0)
+	continue;
+      if (batch_ninputs == alloced) {
+	char** inputs = realloc (batch_inputs, 2 * alloced * sizeof (char*));
+	if (!inputs) {
+	  fprintf (stderr, "%s: Cannot allocate memory\n", progname);
+	  exit (1);
+	}
+	batch_inputs = inputs;
+	alloced *= 2;
+      }
+      batch_inputs [batch_ninputs] = strdup (line);
+      if (!batch_inputs [batch_ninputs++]) {
+	fprintf (stderr, "%s: Cannot allocate memory\n", progname);
+	exit (1);
+      }
+    }
+    free (line);
+    fclose (f);
+  }
+  /* The first input that can be opened starts the job */
+  if (batch_ninputs > 0) {
+    while (!open_input (batch_inputs [batch_next++]))
+      if (batch_next == batch_ninputs)
+	exit (1);
   }
 
   if (output_filename) {
@@ -1644,13 +5374,10 @@ main (int argc, char* argv []) {
     close (fd);
   }
 
-  signal (SIGALRM, report_progress);
-  struct itimerval it = { };
-  it.it_value.tv_sec = 1;
-  it.it_interval.tv_sec = 1;
-  setitimer (ITIMER_REAL, &it, NULL);
+  select_line_kernels ();
 
-  process_rasterdata (&job_options);
+  run_job (&job_options, stats_file);
 
   return 0;
 }
+#endif /* RASTERTOPTCH_NO_MAIN */
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Run ptbench, which fails if an optimised stage produces different
+# output than its reference.  The throughput is recorded in bench.tsv.
+# If BENCH_BASELINE names the bench.tsv of an earlier run, fail when one
+# of BENCH_STAGES (default: page, the whole page from raster lines to
+# printer data) is more than BENCH_THRESHOLD percent (default 25)
+# slower in any case.
+
+builddir=${top_builddir-..}
+threshold=${BENCH_THRESHOLD-25}
+stages=${BENCH_STAGES-page}
+
+"$builddir"/ptbench -t "${BENCH_SECONDS-0.1}" > bench.tsv || exit 1
+cat bench.tsv
+if [ -z "$BENCH_BASELINE" ]; then
+  echo "BENCH_BASELINE not set; throughput not compared"
+  exit 0
+fi
+awk -v threshold="$threshold" -v stages=" $stages " '
+  FNR == 1 || index(stages, " " $2 " ") == 0 { next }
+  NR == FNR { baseline[$1 " " $2] = $3; next }
+  ($1 " " $2) in baseline {
+    min = baseline[$1 " " $2] * (1 - threshold / 100)
+    if ($3 < min) {
+      printf "FAIL: %s %s: %.3f Mlines/s, baseline %.3f\n",
+	     $1, $2, $3, baseline[$1 " " $2]
+      failed = 1
+    }
+  }
+  END { exit failed }' "$BENCH_BASELINE" bench.tsv
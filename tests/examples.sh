@@ -0,0 +1,39 @@
+#!/bin/sh
+# Explain the printer data in Examples/ and compare the output with
+# the stored .ptexplain files, in which runs of raster graphics
+# transfer commands are abbreviated.
+
+examples=${top_srcdir-..}/Examples
+builddir=${top_builddir-..}
+tmp=${TMPDIR-/tmp}/examples.$$
+trap 'rm -f "$tmp".out "$tmp".exp' 0
+
+status=0
+for prn in "$examples"/*/*.prn; do
+  "$builddir"/ptexplain --color=never -i "$prn" | awk '
+    /^[Gg] / {
+      if (n && $1 != cmd) flush()
+      if (n++ == 0) first = $0
+      cmd = $1; last = $0; next
+    }
+    { flush(); print }
+    END { flush() }
+    function flush() {
+      if (n == 1) print first
+      else if (n == 2) { print first; print last }
+      else if (n > 2) {
+	print first; printf "[%d more %s lines]\n", n - 2, cmd; print last
+      }
+      n = 0
+    }' > "$tmp".out
+  # The PNG files were written with --write; their names are not compared
+  grep -v '^Raster data written to ' "${prn%.prn}.ptexplain" > "$tmp".exp
+  if cmp -s "$tmp".out "$tmp".exp; then
+    echo "PASS: $prn"
+  else
+    echo "FAIL: $prn"
+    diff "$tmp".exp "$tmp".out | head -20
+    status=1
+  fi
+done
+exit $status
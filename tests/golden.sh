@@ -0,0 +1,58 @@
+#!/bin/sh
+# Regenerate the printer data of the golden cases and compare it byte
+# for byte with the stored output, then check that ptexplain explains
+# it without errors, and that the job statistics are consistent with
+# it.  With GOLDEN_UPDATE=1, store the output instead.
+
+srcdir=${top_srcdir-..}/tests
+builddir=${top_builddir-..}
+tmp=${TMPDIR-/tmp}/golden.$$
+trap 'rm -f "$tmp".prn "$tmp".tsv "$tmp".err' 0
+
+status=0
+while read -r expected raster options; do
+  case "$expected" in
+    ""|\#*) continue ;;
+  esac
+  if ! "$builddir"/rastertoptch -i "$srcdir/rasters/$raster.ras" \
+       "$options" > "$tmp".prn 2> "$tmp".err; then
+    echo "FAIL: $raster $options: rastertoptch failed"
+    status=1
+    continue
+  fi
+  if [ "${GOLDEN_UPDATE-0}" = 1 ]; then
+    cp "$tmp".prn "$srcdir/golden/$expected.prn"
+  elif ! cmp -s "$tmp".prn "$srcdir/golden/$expected.prn"; then
+    echo "FAIL: $raster $options: output differs from $expected.prn"
+    status=1
+    continue
+  fi
+  # Round trip: no errors may be found in the output
+  "$builddir"/ptexplain --summary=tsv -i "$tmp".prn > "$tmp".tsv
+  if ! awk -F '\t' 'NR == 2 && $2 == 0 && $12 == 0 && $13 == 0 { ok = 1 }
+		    END { exit !ok }' "$tmp".tsv; then
+    echo "FAIL: $raster $options: ptexplain found errors"
+    sed 1d "$tmp".tsv
+    status=1
+    continue
+  fi
+  # Bytes saved by AdaptiveCompression cannot exceed the output, either
+  # way, and the pixel lines cannot take more bytes than the output
+  if ! awk -v size="$(wc -c < "$tmp".prn)" '
+	 function field(name,  v) {
+	   v = $0; sub (".*\"" name "\": ", "", v); sub (/,.*/, "", v)
+	   return v + 0
+	 }
+	 /"saved_bytes": / {
+	   saved = field("saved_bytes")
+	   if (saved < -size || saved > size || field("encoded_bytes") > size)
+	     exit 1
+	 }' "$tmp".err; then
+    echo "FAIL: $raster $options: statistics out of range"
+    grep -o '"\(saved\|encoded\)_bytes": [^,]*' "$tmp".err
+    status=1
+    continue
+  fi
+  echo "PASS: $expected: $raster $options"
+done < "$srcdir/golden.cases"
+exit $status